@@ -12,19 +12,37 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #define CHUNK_SIZE_TEXT 2048
 #define CHUNK_SIZE_FILE 5120
 
 const char *FILE_NAME = "temp.tar.gz";
 
+// framed archive reply to commands with "-c <codec>[:<level>]"
+#define ARCHIVE_MAGIC "W24A"
+#define ARCHIVE_ERROR_MAGIC "W24E"
+#define ARCHIVE_STREAMED -1L
+
+struct archive_header {
+    char magic[4];
+    unsigned char codec;
+    signed char level;
+    char reserved[2];
+    long size; // ARCHIVE_STREAMED : chunks of <uint32 length><data> up to a 0 length
+};
+
+// index = codec id sent by the server
+const char *codec_names[] = {"none", "gzip", "zstd", "lz4", "auto"};
+const char *codec_file_names[] = {"temp.tar", "temp.tar.gz", "temp.tar.zst", "temp.tar.lz4"};
+
 // check if the str1 has str2 in it
 int strContains(const char *str1, const char *str2) {
     return (strstr(str1, str2) != NULL);
 }
 
 // list of allowed commands
-const char *allowed_commands[] = {"quitc", "dirlist -a", "dirlist -t", "w24fn", "w24fz", "w24ft", "w24fdb", "w24fda"};
+const char *allowed_commands[] = {"quitc", "dirlist -a", "dirlist -t", "w24fn", "w24fz", "w24ft", "w24fdb", "w24fda", "w24fq", "w24stats", "w24next"};
 
 // func to validate command
 int command_validator(const char *command) {
@@ -91,6 +109,147 @@ int receive_tar_file(int client_socket) {
     return EXIT_SUCCESS;
 }
 
+// receive exactly length bytes
+int recv_all(int socket, void *data, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t n = recv(socket, (char *) data + received, length - received, 0);
+        if (n <= 0) {
+            if (n == 0) {
+                fprintf(stderr, "error: server closed connection unexpectedly\n");
+            } else {
+                perror("error: receiving from server\n");
+            }
+            return EXIT_FAILURE;
+        }
+        received += n;
+    }
+    return EXIT_SUCCESS;
+}
+
+// copy length bytes from the socket into the file
+int recv_to_file(int socket, FILE *fp, size_t length) {
+    char buffer[CHUNK_SIZE_FILE];
+    while (length > 0) {
+        size_t receiving = length < sizeof(buffer) ? length : sizeof(buffer);
+        if (recv_all(socket, buffer, receiving) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+        fwrite(buffer, 1, receiving, fp);
+        length -= receiving;
+    }
+    return EXIT_SUCCESS;
+}
+
+// framed archive : header, then the sized archive or its chunks
+int receive_archive(int client_socket) {
+    struct archive_header header;
+    if (recv_all(client_socket, &header, sizeof(header)) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    if (memcmp(header.magic, ARCHIVE_ERROR_MAGIC, 4) == 0) {
+        // the message is one short line, the size is not trusted further
+        if (header.size <= 0 || header.size > CHUNK_SIZE_TEXT) {
+            fprintf(stderr, "error: invalid error message size from server : %ld\n", header.size);
+            return EXIT_FAILURE;
+        }
+        char *error_msg = malloc(header.size + 1);
+        if (error_msg == NULL || recv_all(client_socket, error_msg, header.size) == EXIT_FAILURE) {
+            free(error_msg);
+            return EXIT_FAILURE;
+        }
+        error_msg[header.size] = '\0';
+        printf("%s\n", error_msg);
+        free(error_msg);
+        return EXIT_FAILURE;
+    }
+
+    if (memcmp(header.magic, ARCHIVE_MAGIC, 4) != 0 || header.codec > 3 || header.size < ARCHIVE_STREAMED) {
+        fprintf(stderr, "error: invalid archive header from server\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *file_name = codec_file_names[header.codec];
+    printf("receiving %s archive (level %d)\n", codec_names[header.codec], header.level);
+
+    FILE *tar_fp = fopen(file_name, "wb");
+    if (tar_fp == NULL) {
+        perror("error: opening TAR file for writing\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t total_received = 0;
+    int status = EXIT_SUCCESS;
+    if (header.size >= 0) {
+        status = recv_to_file(client_socket, tar_fp, header.size);
+        total_received = header.size;
+    } else {
+        // chunks are sent while the server is still compressing
+        uint32_t length;
+        while ((status = recv_all(client_socket, &length, sizeof(length))) == EXIT_SUCCESS && length > 0) {
+            if ((status = recv_to_file(client_socket, tar_fp, length)) == EXIT_FAILURE) {
+                break;
+            }
+            total_received += length;
+        }
+    }
+    fclose(tar_fp);
+
+    if (status == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    printf("TAR file received of : %ld\n", total_received);
+    printf("TAR received successfully. file : %s\n", file_name);
+    return EXIT_SUCCESS;
+}
+
+// "-c <codec>[:<level>]" of an archive command, NULL if absent
+char *find_codec_option(char *command) {
+    char *option = strstr(command, " -c ");
+    return option == NULL ? NULL : option + 4;
+}
+
+int is_valid_codec(char *option) {
+    char name[16];
+    size_t len = strcspn(option, " ");
+    if (len == 0 || len >= sizeof(name)) {
+        return EXIT_FAILURE;
+    }
+    memcpy(name, option, len);
+    name[len] = '\0';
+
+    char *level = strchr(name, ':');
+    if (level != NULL) {
+        *level++ = '\0';
+        if (*level == '\0' || strspn(level, "0123456789") != strlen(level)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++) {
+        if (strcmp(name, codec_names[i]) == 0) {
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+// send an archive command and receive the reply in the format it asks for
+void request_archive(int client_socket, char *command) {
+    if (send(client_socket, command, strlen(command), 0) < 0) {
+        perror("error: command sending failed\n");
+        return;
+    }
+
+    if (find_codec_option(command) != NULL) {
+        receive_archive(client_socket);
+    } else if (receive_tar_file(client_socket) == EXIT_SUCCESS) {
+        printf("TAR received successfully. file : %s\n", FILE_NAME);
+    }
+}
+
 int is_valid_date(char *date_str) {
     struct tm date_tm;
     // Parse date string into struct tm
@@ -163,23 +322,25 @@ int receive_response_text_with_check(int socket, char *checkString) {
     return EXIT_SUCCESS;
 }
 
-int receive_response_print(int client_socket) {
+// receive one text response, NULL on errors; the caller frees it
+char *receive_text(int client_socket) {
     // receive response length from server
     int response_len;
-    if (recv(client_socket, &response_len, sizeof(int), 0) != sizeof(int)) {
+    if (recv(client_socket, &response_len, sizeof(int), MSG_WAITALL) != sizeof(int) || response_len < 0) {
         perror("error: receiving response length\n");
-
-        return EXIT_FAILURE;
+        return NULL;
     }
 
-    char *response_text = malloc(response_len * sizeof(char));
-    strcpy(response_text, "");
+    char *response_text = malloc(response_len + 1);
+    if (response_text == NULL) {
+        perror("error: allocating response\n");
+        return NULL;
+    }
 
-    // receive and print response from server
-    char buffer[CHUNK_SIZE_FILE];
+    // receive response from server
     int total_read = 0;
     while (total_read < response_len) {
-        int chunk_size = recv(client_socket, buffer + total_read, response_len - total_read, 0);
+        int chunk_size = recv(client_socket, response_text + total_read, response_len - total_read, 0);
         if (chunk_size <= 0) {
             if (chunk_size == 0) {
                 perror("server closed connection unexpectedly\n");
@@ -188,13 +349,51 @@ int receive_response_print(int client_socket) {
             }
             break;
         }
-        strcat(response_text, buffer);
         total_read += chunk_size;
     }
     response_text[total_read] = '\0';
-    printf("%s\n", response_text);
+    return response_text;
+}
 
-    return EXIT_SUCCESS;
+// print a text response; a page ending with "cursor: <token>" is followed by
+// "w24next <token>" until the last page, so only one page is held at a time
+int receive_response_print(int client_socket) {
+    while (1) {
+        char *response_text = receive_text(client_socket);
+        if (response_text == NULL) {
+            return EXIT_FAILURE;
+        }
+
+        // the cursor is the last line of the page
+        size_t length = strlen(response_text);
+        char *last_line = response_text + length;
+        if (last_line > response_text && last_line[-1] == '\n') {
+            last_line--;
+        }
+        while (last_line > response_text && last_line[-1] != '\n') {
+            last_line--;
+        }
+
+        char next[CHUNK_SIZE_TEXT];
+        int more = strncmp(last_line, "cursor: ", 8) == EXIT_SUCCESS;
+        if (more) {
+            snprintf(next, sizeof(next), "w24next %s", last_line + 8);
+            next[strcspn(next, "\n")] = '\0';
+            *last_line = '\0';
+            printf("%s", response_text);
+        } else {
+            printf("%s\n", response_text);
+        }
+        free(response_text);
+
+        if (!more) {
+            return EXIT_SUCCESS;
+        }
+        if (send(client_socket, next, strlen(next), 0) < 0) {
+            perror("error: command sending failed\n");
+            return EXIT_FAILURE;
+        }
+    }
 }
 
 int main() {
@@ -261,6 +460,13 @@ int main() {
             continue;
         }
 
+        char *codec = find_codec_option(command);
+        if (codec != NULL && is_valid_codec(codec) == EXIT_FAILURE) {
+            printf("error: Invalid codec : %s\n", codec);
+            printf("please use -c none|gzip|zstd|lz4|auto[:level]\n");
+            continue;
+        }
+
         if (strncmp(command, "quitc", 5) == EXIT_SUCCESS) { // cmd 8
             // send command to server
             if (send(client_socket, command, strlen(command), 0) < 0) {
@@ -325,19 +531,12 @@ int main() {
             }
 
             // Send command to server
-            if (send(client_socket, command, strlen(command), 0) < 0) {
-                perror("error: command sending failed\n");
-                continue;
-            }
-
-            if (receive_tar_file(client_socket) == EXIT_SUCCESS) {
-                printf("TAR received successfully. file : %s\n", FILE_NAME);
-            }
+            request_archive(client_socket, command);
         } else if (strncmp(command, "w24ft ", 6) == EXIT_SUCCESS) { // cmd 5
 //            printf("sending command: %s\n", command); // Debug print
 
             char *t_cmd;
-            t_cmd = malloc(strlen(command) * sizeof(char));
+            t_cmd = malloc((strlen(command) + 1) * sizeof(char));
             strcpy(t_cmd, command);
 
             int MAX_EXTENSIONS = 3;
@@ -349,7 +548,12 @@ int main() {
             int num_extensions = 0;
 
             while (extensions != NULL) {
-                num_extensions++;
+                if (strcmp(extensions, "-c") == 0 || strcmp(extensions, "-n") == 0) {
+                    // codec or file count option, not a file type
+                    strtok(NULL, delimiters);
+                } else {
+                    num_extensions++;
+                }
                 extensions = strtok(NULL, delimiters);
             }
             free(t_cmd);
@@ -361,14 +565,7 @@ int main() {
 
             printf("command: %s\n", command);
             // Send command to server
-            if (send(client_socket, command, strlen(command), 0) < 0) {
-                perror("error: command sending failed\n");
-                continue;
-            }
-
-            if (receive_tar_file(client_socket) == EXIT_SUCCESS) {
-                printf("TAR received successfully. file : %s\n", FILE_NAME);
-            }
+            request_archive(client_socket, command);
         } else if (strncmp(command, "w24fdb ", 6) == 0 || strncmp(command, "w24fda ", 6) == 0) { // cmd 6 + 7
 //            printf("sending command: %s\n", command); // Debug print
 
@@ -380,17 +577,13 @@ int main() {
                 continue;
             } else {
                 // Send command to server
-                if (send(client_socket, command, strlen(command), 0) < 0) {
-                    perror("error: command sending failed\n");
-                    continue;
-                }
+                request_archive(client_socket, command);
 //                printf("Command sent\n"); // Debug print
-
-                if (receive_tar_file(client_socket) == EXIT_SUCCESS) {
-                    printf("TAR received successfully. file : %s\n", FILE_NAME);
-                }
             }
 
+        } else if (strncmp(command, "w24fq ", 6) == EXIT_SUCCESS) { // cmd 9
+            // the query terms are checked by the server
+            request_archive(client_socket, command);
         } else {
             // cmd 1 + 2
             // Send command to server
@@ -1,7 +1,7 @@
 //
 // Created by Nayeem Mehedi on 2024-04-02.
 //
-#define _XOPEN_SOURCE 500 // Required for nftw
+#define _GNU_SOURCE // SO_REUSEPORT, MAP_ANONYMOUS, statx
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,10 +11,39 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
-#include <ftw.h>
 #include <pwd.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+#include <sys/sysmacros.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
 
 #define SERVER_NAME "server"
 
@@ -24,70 +53,209 @@
 #define MIRROR_1_PORT 10002
 #define MIRROR_2_PORT 10003
 
-#define MAX_RESPONSE_LENGTH_TEXT 1048576
 #define CHUNK_SIZE_TEXT 2048
 
 #define CHUNK_SIZE_FILE 5120
 
-#define MAX_CLIENTS 5
-// limit for file paths
-#define MAX_FILE_PATHS 10
+// bytes handed to sendfile() per call, and per wakeup of one session
+#define SENDFILE_CHUNK (8 * 1024 * 1024)
+// read size of the copy fallback when sendfile() is not supported
+#define COPY_CHUNK_SIZE 65536
+
+// TAR writer : read size of archived files
+#define TAR_BLOCK_SIZE 512
+#define TAR_READ_CHUNK 65536
+
+// parallel compression : the TAR stream is cut into blocks compressed on the compression threads
+#define ARCHIVE_BLOCK_SIZE (256 * 1024)
+// deflate window, the tail of the previous block primes the next one
+#define GZ_DICT_SIZE 32768
+// blocks of one archive in flight (compressing or waiting to be written)
+#define MAX_INFLIGHT_BLOCKS 64
+// incompressible members : bytes sampled from the start of a file, smaller files are always compressed
+#define SAMPLE_SIZE 4096
+// chi-square of the sampled byte histogram against uniform, random data stays around 255
+#define SAMPLE_CHI_SQUARE_LIMIT 400
+
+// archive codecs, requested with "-c <codec>[:<level>]" on the TAR commands
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define CODEC_ZSTD 2
+#define CODEC_LZ4 3
+#define CODEC_AUTO 4 // resolved to one of the above once the files are known
+
+// archive framing, used when the client asked for a codec :
+// header, then either `size` bytes or (size -1) chunks of <uint32 length><data> up to a 0 length
+#define ARCHIVE_MAGIC "W24A"
+#define ARCHIVE_ERROR_MAGIC "W24E" // header size is the length of the error text that follows
+#define ARCHIVE_STREAMED -1L
+// a streaming session is woken up after this many new archive bytes
+#define STREAM_SIGNAL_BYTES (256 * 1024)
+
+struct archive_header {
+    char magic[4];
+    unsigned char codec;
+    signed char level;
+    char reserved[2];
+    long size;
+};
+
+// archive staging per worker : memfd while the memory budget (-m, MB) lasts,
+// then unlinked files in the spill directory (-s) limited by the disk budget (-d, MB, 0 = unlimited)
+#define DEFAULT_MEMORY_BUDGET_MB 512
+#define DEFAULT_SPILL_DIR "/tmp"
+
+// file index : items per block of the ordered (size, time) indexes
+#define ORDERED_BLOCK_MAX 256
+// ordered indexes of the file index, KEY_BTIME only holds files with a known birth time
+#define KEY_SIZE 0
+#define KEY_MTIME 1
+#define KEY_CTIME 2
+#define KEY_BTIME 3
+#define ORDERED_KEYS 4
+// order of date query results : index order (default), newest or oldest first
+#define ORDER_INDEX 0
+#define ORDER_NEWEST 1
+#define ORDER_OLDEST 2
+// extension index : hash buckets, longer extensions are not indexed
+#define EXT_BUCKETS 1024
+#define MAX_EXTENSION_LENGTH 15
+// trigram index of the paths for w24fn : hash buckets
+#define TRIGRAM_BUCKETS 65536
+// getdents64() buffer of each directory scan thread
+#define SCAN_BUFFER_SIZE (256 * 1024)
+// index snapshot : file format version, default file (-i, "off" disables it) and
+// how often the index writer saves a changed index (seconds)
+#define SNAPSHOT_VERSION 1
+#define DEFAULT_SNAPSHOT_PATH "/tmp/w24_" SERVER_NAME ".index"
+#define SNAPSHOT_INTERVAL 300
+// startup walks tried before the index writer gives up
+#define INDEX_BUILD_ATTEMPTS 3
+// shared index image : published once file events pause this long, or at the latest this often
+#define PUBLISH_DELAY_MS 100
+#define PUBLISH_MAX_DELAY_MS 1000
+// every image is a full copy of the index : one more second between images per this many bytes
+#define PUBLISH_BYTES_PER_SECOND (16L * 1024 * 1024)
+// directory polling without inotify (seconds, -p sets it and turns inotify off)
+#define DEFAULT_POLL_INTERVAL 10
+
+// built archives kept per worker for repeated queries (-C, MB, 0 = off)
+#define DEFAULT_CACHE_BUDGET_MB 256
+#define CACHE_BUCKETS 256
+
+// listen() backlog of each worker, can be changed with -b
+#define DEFAULT_LISTEN_BACKLOG 128
+// upper bound for the number of pre-forked workers (-w)
+#define MAX_WORKERS 64
 #define MAX_PATH_LENGTH 1024
 
 #define MAX_FILE_TYPES 3
 
-int connection = 0;
-
-// decrement the connection count when a child exits / client closes connection
-void handle_child_exit(int signum) {
-    if (signum == SIGCHLD) {
-        printf("child process exited\n");
-        connection--;
-
-        printf("total connected clients: %d\n", connection);
+// event loop
+#define MAX_EVENTS 256
+#define CMD_BUFFER_SIZE 1024
+
+// states of the per-connection state machine
+#define SESSION_HANDSHAKE 0 // waiting for the connection type (CLIENT / SERVER)
+#define SESSION_SERVER 1    // mirror connection, waiting for the COUNT request
+#define SESSION_COMMAND 2   // client connection, waiting for the next command
+#define SESSION_SENDING 3   // writing a response / TAR file to the client
+#define SESSION_CLOSING 4   // writing the last response, close afterwards
+#define SESSION_WORKING 5   // waiting for a search / archive job on the thread pool
+#define SESSION_BALANCING 6 // client handshake, waiting for the connection counts of the other nodes
+#define SESSION_COUNTING 7  // outgoing connection asking another node for its connection count
+
+// upper bound for jobs waiting for a pool thread, further requests are refused
+#define MAX_QUEUED_JOBS 1024
+
+struct archive_job;
+struct listing;
+
+// one pre-forked worker, shared between the master and all workers
+struct worker_slot {
+    pid_t pid;
+    int connections; // client sessions handled by this worker
+};
+
+struct worker_slot *workers;
+int worker_count = 0;
+int worker_id = -1;
+
+// number of connected clients of this node, summed over all workers
+int client_count() {
+    int total = 0;
+    for (int i = 0; i < worker_count; i++) {
+        total += __atomic_load_n(&workers[i].connections, __ATOMIC_RELAXED);
     }
+    return total;
 }
 
+// one connected socket, driven by the event loop
+struct session {
+    int socket;
+    int state;
+    int is_client;
+    char client_ip[INET_ADDRSTRLEN];
+
+    // framed output waiting to be written (response length / TAR size + data)
+    char *out_buf;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+
+    // TAR file being streamed after out_buf is drained
+    int tar_fd;
+    long tar_size;
+    off_t tar_offset;
+    int tar_copy; // sendfile() unsupported, copy through out_buf
+
+    // archive sent in chunks while the job is still writing it, tar_size is the end of the current chunk
+    int streaming;
+    int stream_waiting; // everything written so far is sent
+
+    // staging budget held by tar_fd, returned when it is closed
+    off_t staged_bytes;
+    int staged_on_disk;
+
+    // job running on the thread pool for this session
+    struct archive_job *job;
+
+    // paged dirlist / w24fn -p still being read with w24next
+    struct listing *listing;
+
+    // SESSION_BALANCING : count requests still running (NULL once done) and their counts
+    struct session *peers[2];
+    int peer_counts[2];
+
+    // SESSION_COUNTING : the count of node `peer` for client (NULL once the client is gone)
+    struct session *client;
+    int peer;
+    int count;
+    int count_received; // bytes of count read so far
+    int count_sent;     // connected and the request is written
+    struct timespec count_start;
+    struct session *count_next; // count requests of this worker, see expire_counts()
+};
+
 // check if the str1 has str2 in it
 int strContains(char *str1, char *str2) {
     return (strstr(str1, str2) != NULL);
 }
 
-// check if a string ends with another sub string
-int endswith(char* str, char* substr) {
-    if (!str || !substr)
-        return EXIT_FAILURE;
-
-    size_t length_of_string    = strlen(str);
-    size_t length_of_substring = strlen(substr);
-
-    if (length_of_substring > length_of_string)
-        return EXIT_FAILURE;
-
-    char* endOfTheString = &str[length_of_string - length_of_substring];
-
-    return strcmp(endOfTheString, substr) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
-}
-
-// remove a file by fileName
-int remove_file(char *filename) {
-    if (remove(filename) == 0) {
-        printf("file %s deleted successfully.\n", filename);
-        return 0;
-    } else {
-        perror("error: deleting file\n");
-        return 1;
+// the path is resolved once and shared by all pool threads
+char* get_directory() {
+    static char *downloadDir = NULL;
+    if (downloadDir != NULL) {
+        return downloadDir;
     }
-}
 
-char* get_directory() {
     // Get the home directory path
     struct passwd *pw = getpwuid(getuid());
     const char *homedir = pw->pw_dir;
 
     // TODO change directory
     // Append "/Downloads" to the home directory
-    char *downloadDir = malloc(strlen(homedir) + strlen("/Downloads") + 1);
+    downloadDir = malloc(strlen(homedir) + strlen("/Downloads") + 1);
     strcpy(downloadDir, homedir);
     strcat(downloadDir, "/Downloads");
 
@@ -96,869 +264,6785 @@ char* get_directory() {
 
 /////////////// RESPONSE SENDING START //////////////////////////////////
 
-int send_response(int client_socket, const char *response) {
-    printf("preparing response : %s\n", response);
+// append raw bytes to the output queue of a session
+int queue_output(struct session *s, const void *data, size_t length) {
+    if (s->out_len + length > s->out_cap) {
+        size_t new_cap = s->out_cap == 0 ? CHUNK_SIZE_FILE : s->out_cap;
+        while (new_cap < s->out_len + length) {
+            new_cap *= 2;
+        }
+
+        char *new_buf = realloc(s->out_buf, new_cap);
+        if (new_buf == NULL) {
+            perror("error: allocating output buffer\n");
+            return EXIT_FAILURE;
+        }
+        s->out_buf = new_buf;
+        s->out_cap = new_cap;
+    }
+
+    memcpy(s->out_buf + s->out_len, data, length);
+    s->out_len += length;
+
+    if (s->state == SESSION_COMMAND) {
+        s->state = SESSION_SENDING;
+    }
+    return EXIT_SUCCESS;
+}
+
+// queue a text response : total size (int) followed by the text
+int send_response(struct session *s, const char *response) {
     int response_length = strlen(response);
+    // listings run to megabytes, only their size is logged
+    printf("preparing response : %d bytes\n", response_length);
 
     // send the total size of the text response to the client
-    if (send(client_socket, &response_length, sizeof(int), 0) < 0) {
+    if (queue_output(s, &response_length, sizeof(int)) == EXIT_FAILURE) {
         perror("error: sending TAR file size\n");
         return EXIT_FAILURE;
     }
 
-    // send response data chunk by chunk
-    int sent_total = 0;
-    while (sent_total < response_length) {
-        int sending = (response_length - sent_total) < CHUNK_SIZE_TEXT ? (response_length - sent_total) : CHUNK_SIZE_TEXT;
-        int sent = send(client_socket, response + sent_total, sending, 0);
-
-        if (sent < 0) {
-            perror("error: sending response data\n");
-            return EXIT_FAILURE;
-        }
-        sent_total += sent;
+    // response data is written chunk by chunk by the event loop
+    if (queue_output(s, response, response_length) == EXIT_FAILURE) {
+        perror("error: sending response data\n");
+        return EXIT_FAILURE;
     }
 
-    printf("sent response\n");
     return EXIT_SUCCESS;
 }
 
-int send_tar_file(int client_socket, char *file_name) {
-    // open the TAR file for reading
-    FILE *tar_fp = fopen(file_name, "rb");
-    if (tar_fp == NULL) {
-        send_response(client_socket, "error : failed to open TAR file\n");
+// queue a TAR file : total size (long) followed by the file contents
+// the session takes over tar_fd and closes it once sent
+int send_tar_file(struct session *s, int tar_fd) {
+    // determine the total size of the TAR file
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0) {
+        send_response(s, "error : failed to open TAR file\n");
+        close(tar_fd);
         return EXIT_FAILURE;
     }
-
-    // determine the total size of the TAR file
-    // ref : https://stackoverflow.com/questions/238603/how-can-i-get-a-files-size-in-c
-    fseek(tar_fp, 0, SEEK_END);
-    long tar_size = ftell(tar_fp);
-    fseek(tar_fp, 0, SEEK_SET);
+    long tar_size = st.st_size;
 
     // send the total size of the TAR file to the client
-    if (send(client_socket, &tar_size, sizeof(long), 0) < 0) {
+    if (queue_output(s, &tar_size, sizeof(long)) == EXIT_FAILURE) {
         perror("error: sending TAR file size\n");
-        fclose(tar_fp);
+        close(tar_fd);
         return EXIT_FAILURE;
     }
 
-    // read and send the contents of the TAR file
-    char buffer[CHUNK_SIZE_FILE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), tar_fp)) > 0) {
-        if (send(client_socket, buffer, bytes_read, 0) < 0) {
-            perror("error: sending TAR file chunk\n");
-            break;
+    // the contents are sent with sendfile() by flush_session()
+    s->tar_fd = tar_fd;
+    s->tar_size = tar_size;
+    s->tar_offset = 0;
+    s->tar_copy = 0;
+
+    return EXIT_SUCCESS;
+}
+
+int next_stream_chunk(struct session *s);
+void release_staging(off_t bytes, int on_disk);
+
+void close_tar_file(struct session *s) {
+    close(s->tar_fd);
+    s->tar_fd = -1;
+    release_staging(s->staged_bytes, s->staged_on_disk);
+    s->staged_bytes = 0;
+}
+
+// write as much pending output as the socket accepts
+// returns 1 when everything is sent, 0 when the socket is full, -1 on error,
+// 2 when a streamed archive waits for the job to write more
+int flush_session(struct session *s) {
+    // bytes of the TAR file sent in this call, other sessions get a turn after SENDFILE_CHUNK
+    long budget = SENDFILE_CHUNK;
+
+    while (1) {
+        while (s->out_sent < s->out_len) {
+            ssize_t sent = send(s->socket, s->out_buf + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("error: sending response data\n");
+                return -1;
+            }
+            s->out_sent += sent;
+        }
+        s->out_len = 0;
+        s->out_sent = 0;
+
+        if (s->tar_fd < 0) {
+            return 1;
         }
-//        printf("bytes sent : %ld\n", bytes_read);
-    }
 
-    printf("TAR file sent: %ld bytes\n", tar_size);
+        long remaining = s->tar_size - s->tar_offset;
+        if (remaining == 0 && s->streaming) {
+            int status = next_stream_chunk(s);
+            if (status <= 0) {
+                return status == 0 ? 2 : -1;
+            }
+            continue;
+        }
+        if (remaining == 0) {
+            printf("TAR file sent: %ld bytes\n", s->tar_size);
+            close_tar_file(s);
+            return 1;
+        }
 
-    // close the TAR file
-    fclose(tar_fp);
+        if (budget <= 0) {
+            // still writable, the event loop calls again after serving the others
+            return 0;
+        }
 
-    // remove the TAR file
-    remove_file(file_name);
+        size_t count = remaining < SENDFILE_CHUNK ? remaining : SENDFILE_CHUNK;
+        ssize_t sent;
 
-    return EXIT_SUCCESS;
+        if (!s->tar_copy) {
+            // zero-copy : the kernel moves the pages straight to the socket,
+            // tar_offset is advanced by the bytes actually sent
+            sent = sendfile(s->socket, s->tar_fd, &s->tar_offset, count);
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                printf("sendfile not supported, copying TAR file\n");
+                s->tar_copy = 1;
+                continue;
+            }
+        } else {
+            // fallback : read the next chunk into out_buf, partial sends are handled above
+            char buffer[COPY_CHUNK_SIZE];
+            sent = pread(s->tar_fd, buffer, count < sizeof(buffer) ? count : sizeof(buffer), s->tar_offset);
+            if (sent > 0) {
+                if (queue_output(s, buffer, sent) == EXIT_FAILURE) {
+                    return -1;
+                }
+                s->tar_offset += sent;
+            }
+        }
+
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("error: sending TAR file chunk\n");
+            return -1;
+        }
+
+        if (sent == 0) {
+            // the client is waiting for the announced size, drop the connection
+            fprintf(stderr, "error: TAR file ended %ld bytes early\n", remaining);
+            return -1;
+        }
+
+        budget -= sent;
+    }
 }
 
 /////////////// RESPONSE SENDING END ////////////////////////////////////
 
-///////////////// cmd 3 START ////////////////////////
+////////////// COMMON START //////////////////////////
 
-int FILE_FOUND_STATUS = 0;
-char *fileNameOrExt;
-char *textResponse;
+// archive_job types, numbered like the commands
+#define JOB_SEARCH 3 // w24fn
+#define JOB_SIZE 4   // w24fz
+#define JOB_TYPES 5  // w24ft
+#define JOB_BEFORE 6 // w24fdb
+#define JOB_AFTER 7  // w24fda
+#define JOB_QUERY 9  // w24fq
+#define JOB_NEXT 10  // w24next of a w24fn -p listing
+
+// a search / archive request, built on a pool thread and answered by the event loop
+struct archive_job {
+    int type;
+    struct session *session; // NULL once the client is gone
+    struct archive_job *next;
+    unsigned long id;
+
+    // command arguments (file name, file types, date)
+    char args[CMD_BUFFER_SIZE];
+
+    // cmd 3 : w24fn -p, the listing is handed to the session while pages are left
+    int page_size;
+    struct listing *listing;
+
+    // cmd 4
+    off_t size1;
+    off_t size2;
+
+    //cmd 5
+    char file_types[MAX_FILE_TYPES][MAX_PATH_LENGTH];
+    int num_file_types;
+
+    //cmd 6
+    time_t before_date_time;
+    // cmd 6 & 7 options : -t mtime|ctime|btime, -o newest|oldest
+    int time_key;
+    int time_order;
+
+    //cmd 7
+    time_t after_date_time;
+
+    // collected files : entries of the index image the job holds, in archive order
+    struct image_map *image;
+    int *entries;
+    int file_count;
+    int entry_capacity;
+    long limit; // -n, 0 : every match
+
+    // result : a text response, or the archive to send
+    char *text;
+    int archive_fd;
+    off_t staged_bytes; // staging budget reserved for archive_fd
+    int staged_on_disk;
+
+    // archive codec, framed = requested with -c and streamed while it is written
+    int codec;
+    int level;
+    int framed;
+
+    // archive bytes written so far, published to the event loop by report_archive_progress()
+    off_t produced;
+    off_t signaled;
+    int progress_queued;
+    struct archive_job *progress_next;
+    int completed; // finish_job() ran, the stream only has to be drained
+};
+
+// job of the calling pool thread, used by the match callbacks
+__thread struct archive_job *current_job;
 
-int fileDetailsIfFileFound(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    if (typeflag == FTW_F) {
-        if (strContains(fpath, fileNameOrExt)) {
-            // file found, send its information to the client
-            char response[2048];
+///////////////// COMMON END //////////////////////////
+
+//////////////////////////// ORDERED INDEX START ///////////////////////////////////////
+
+// int64 key -> file index entry, kept in key order : sorted blocks of at most
+// ORDERED_BLOCK_MAX items and a fanout array with the first item of every block,
+// a lookup is a binary search over the fanout then one inside the block
+struct ordered_item {
+    int64_t key;
+    int entry; // ties are ordered by entry, so an item can be found and removed exactly
+};
+
+struct ordered_block {
+    int count;
+    struct ordered_item items[ORDERED_BLOCK_MAX];
+};
+
+struct ordered_index {
+    struct ordered_block **blocks;
+    struct ordered_item *first; // fanout : first item of each block
+    int block_count;
+    int block_capacity;
+    long size;
+};
+
+int ordered_compare(const struct ordered_item *a, const struct ordered_item *b) {
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    return a->entry < b->entry ? -1 : a->entry > b->entry;
+}
 
-            sprintf(response, "Filename: %s\nPath:%s\nSize: %ld bytes\nDate created: %sPermissions: %o\n",
-                    fpath + ftwbuf->base, fpath, sb->st_size, ctime(&sb->st_ctime),
-                    sb->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+int ordered_compare_items(const void *a, const void *b) {
+    return ordered_compare(a, b);
+}
+
+void ordered_clear(struct ordered_index *index) {
+    for (int i = 0; i < index->block_count; i++) {
+        free(index->blocks[i]);
+    }
+    free(index->blocks);
+    free(index->first);
+    memset(index, 0, sizeof(struct ordered_index));
+}
 
-            strcpy(textResponse, response);
-            // stop traversal since file is found
-            FILE_FOUND_STATUS = 1;
-            return 1; // return non-zero to stop traversal
+// make room for a block at position, returns NULL when out of memory
+struct ordered_block *ordered_insert_block(struct ordered_index *index, int position) {
+    if (index->block_count == index->block_capacity) {
+        int capacity = index->block_capacity == 0 ? 64 : index->block_capacity * 2;
+        struct ordered_block **blocks = realloc(index->blocks, capacity * sizeof(struct ordered_block *));
+        if (blocks == NULL) {
+            return NULL;
         }
+        index->blocks = blocks;
+        struct ordered_item *first = realloc(index->first, capacity * sizeof(struct ordered_item));
+        if (first == NULL) {
+            return NULL;
+        }
+        index->first = first;
+        index->block_capacity = capacity;
     }
 
-    return 0; // Continue traversal
-}
+    struct ordered_block *block = malloc(sizeof(struct ordered_block));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->count = 0;
 
-// search for file using nftw and send response
-int search_file(const char *filename, int client_socket) {
-    fileNameOrExt = malloc(strlen(filename) * sizeof(char));
-    strcpy(fileNameOrExt, filename);
+    memmove(index->blocks + position + 1, index->blocks + position, (index->block_count - position) * sizeof(struct ordered_block *));
+    memmove(index->first + position + 1, index->first + position, (index->block_count - position) * sizeof(struct ordered_item));
+    index->blocks[position] = block;
+    index->block_count++;
+    return block;
+}
 
-    int response_length = MAX_RESPONSE_LENGTH_TEXT;
-    textResponse = malloc(response_length * sizeof(char));
+// bulk load from unsorted items, blocks are filled to 3/4 to leave room for inserts
+int ordered_build(struct ordered_index *index, struct ordered_item *items, long count) {
+    ordered_clear(index);
+    qsort(items, count, sizeof(struct ordered_item), ordered_compare_items);
 
-    // start the directory tree traversal from the given directory
-    if (nftw(get_directory(), fileDetailsIfFileFound, 20, FTW_PHYS) == -1) {
-        // Failed to traverse directory tree
-        send_response(client_socket, "error: failed to traverse directory tree\n");
-        free(fileNameOrExt);
-        free(textResponse);
-        return -1;
+    int per_block = ORDERED_BLOCK_MAX * 3 / 4;
+    for (long i = 0; i < count; i += per_block) {
+        struct ordered_block *block = ordered_insert_block(index, index->block_count);
+        if (block == NULL) {
+            return EXIT_FAILURE;
+        }
+        block->count = count - i < per_block ? count - i : per_block;
+        memcpy(block->items, items + i, block->count * sizeof(struct ordered_item));
+        index->first[index->block_count - 1] = block->items[0];
     }
+    index->size = count;
+    return EXIT_SUCCESS;
+}
 
-    if (FILE_FOUND_STATUS == 0) {
-        // File not found in the directory tree
-        send_response(client_socket, "File not found\n");
-        free(fileNameOrExt);
-        free(textResponse);
-    } else {
-        send_response(client_socket, textResponse);
-        FILE_FOUND_STATUS = 0; // changed for next execution
-        free(fileNameOrExt);
-        free(textResponse);
+// last block whose first item is <= item (0 when item sorts before everything)
+int ordered_find_block(struct ordered_index *index, const struct ordered_item *item) {
+    int low = 0;
+    int high = index->block_count - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (ordered_compare(&index->first[middle], item) <= 0) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
     }
+    return low;
+}
 
-    return 0;
+// first position in the block whose item is >= item
+int ordered_lower_bound(struct ordered_block *block, const struct ordered_item *item) {
+    int low = 0;
+    int high = block->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (ordered_compare(&block->items[middle], item) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
 }
 
-///////////////// cmd 3 END ///////////////////////////
+int ordered_insert(struct ordered_index *index, int64_t key, int entry) {
+    struct ordered_item item = {key, entry};
 
-////////////// COMMON START //////////////////////////
+    if (index->block_count == 0 && ordered_insert_block(index, 0) == NULL) {
+        return EXIT_FAILURE;
+    }
 
-// global variables to store file paths
-char file_paths[MAX_FILE_PATHS][MAX_PATH_LENGTH];
-int file_count = 0;
+    int b = ordered_find_block(index, &item);
+    struct ordered_block *block = index->blocks[b];
 
-char* TAR_FILE_NAME = "temp.tar.gz";
+    if (block->count == ORDERED_BLOCK_MAX) {
+        // split in halves, the upper half becomes the next block
+        struct ordered_block *upper = ordered_insert_block(index, b + 1);
+        if (upper == NULL) {
+            return EXIT_FAILURE;
+        }
+        upper->count = ORDERED_BLOCK_MAX / 2;
+        block->count = ORDERED_BLOCK_MAX - upper->count;
+        memcpy(upper->items, block->items + block->count, upper->count * sizeof(struct ordered_item));
+        index->first[b + 1] = upper->items[0];
+
+        if (ordered_compare(&item, &upper->items[0]) >= 0) {
+            block = upper;
+            b++;
+        }
+    }
 
-// cmd 4
-int size1 = -1;
-int size2 = -1;
+    int position = ordered_lower_bound(block, &item);
+    memmove(block->items + position + 1, block->items + position, (block->count - position) * sizeof(struct ordered_item));
+    block->items[position] = item;
+    block->count++;
+    index->first[b] = block->items[0];
+    index->size++;
+    return EXIT_SUCCESS;
+}
 
-//cmd 5
-char file_types[MAX_FILE_TYPES][MAX_PATH_LENGTH];
-int num_file_types = 0;
+void ordered_remove(struct ordered_index *index, int64_t key, int entry) {
+    struct ordered_item item = {key, entry};
+    if (index->block_count == 0) {
+        return;
+    }
 
-//cmd 6
-time_t before_date_time;
+    int b = ordered_find_block(index, &item);
+    struct ordered_block *block = index->blocks[b];
+    int position = ordered_lower_bound(block, &item);
+    if (position == block->count || ordered_compare(&block->items[position], &item) != 0) {
+        return;
+    }
 
-//cmd 7
-time_t after_date_time;
+    memmove(block->items + position, block->items + position + 1, (block->count - position - 1) * sizeof(struct ordered_item));
+    block->count--;
+    index->size--;
 
-void clear_file_paths() {
-    for (int i = 0; i < file_count; i++) {
-        memset(file_paths[i], '\0', MAX_PATH_LENGTH); // set each element to the null character
+    if (block->count > 0) {
+        index->first[b] = block->items[0];
     }
-    file_count = 0;
 
-    for (int i = 0; i < num_file_types; i++) {
-        memset(file_types[i], '\0', MAX_PATH_LENGTH);
+    // fold a sparse block into its successor, an empty one is dropped
+    if (b + 1 < index->block_count && block->count + index->blocks[b + 1]->count <= ORDERED_BLOCK_MAX * 3 / 4) {
+        struct ordered_block *next = index->blocks[b + 1];
+        memmove(next->items + block->count, next->items, next->count * sizeof(struct ordered_item));
+        memcpy(next->items, block->items, block->count * sizeof(struct ordered_item));
+        next->count += block->count;
+        block->count = 0;
+        index->first[b + 1] = next->items[0];
+    }
+    if (block->count == 0 && index->block_count > 1) {
+        free(block);
+        memmove(index->blocks + b, index->blocks + b + 1, (index->block_count - b - 1) * sizeof(struct ordered_block *));
+        memmove(index->first + b, index->first + b + 1, (index->block_count - b - 1) * sizeof(struct ordered_item));
+        index->block_count--;
     }
-    num_file_types = 0;
-
-    size1 = -1;
-    size2 = -1;
-    before_date_time = 0;
-    after_date_time = 0;
 }
 
-///////////////// COMMON END //////////////////////////
+// call visit for every item with low <= key <= high in key order, stops when visit returns non-zero
+void ordered_range(struct ordered_index *index, int64_t low, int64_t high, int (*visit)(const struct ordered_item *item, void *arg), void *arg) {
+    if (index->block_count == 0 || low > high) {
+        return;
+    }
 
-///////////////// cmd 4 START ////////////////////////
+    struct ordered_item start = {low, INT32_MIN};
+    int b = ordered_find_block(index, &start);
+    int position = ordered_lower_bound(index->blocks[b], &start);
 
-// Define a callback function for nftw
-int collectFilePaths(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    // check if it is a file
-    if (typeflag == FTW_F) {
-        // check if maximum number of file paths reached
-        if (file_count < MAX_FILE_PATHS) {
-            // check if the file size is between size1 and size2
-            if(sb->st_size >= size1 && sb->st_size <= size2) {
-                // append the file path to the array
-                strcpy(file_paths[file_count], fpath);
-                file_count++;
+    for (; b < index->block_count; b++, position = 0) {
+        struct ordered_block *block = index->blocks[b];
+        for (; position < block->count; position++) {
+            if (block->items[position].key > high || visit(&block->items[position], arg)) {
+                return;
             }
-        } else {
-            // return non-zero to stop traversal
-            return 1;
         }
     }
-    // continue traversal
-    return 0;
 }
 
-int create_file_list(int size11, int size22) {
-    size1 = size11;
-    size2 = size22;
-    // Get the home directory path
-    struct passwd *pw = getpwuid(getuid());
+//////////////////////////// ORDERED INDEX END ///////////////////////////////////////
+
+//////////////////////////// EXTENSION INDEX START ///////////////////////////////////////
+
+// case folded extension -> posting list of file index entries in ascending order,
+// with the number of files and bytes per extension
+struct ext_posting {
+    char ext[MAX_EXTENSION_LENGTH + 1];
+    int *entries;
+    int count;
+    int capacity;
+    long long bytes;
+    struct ext_posting *next; // same bucket
+};
+
+struct ext_index {
+    struct ext_posting *buckets[EXT_BUCKETS];
+    int extensions;
+};
+
+// extension of a file name, lower case and without the dot; 0 when it has none
+// (no dot, a leading dot only, or longer than MAX_EXTENSION_LENGTH)
+int file_extension(const char *name, char *ext) {
+    const char *dot = strrchr(name, '.');
+    if (dot == NULL || dot == name || dot[1] == '\0' || strlen(dot + 1) > MAX_EXTENSION_LENGTH) {
+        return 0;
+    }
+    int i = 0;
+    for (const char *p = dot + 1; *p != '\0'; p++) {
+        ext[i++] = tolower((unsigned char) *p);
+    }
+    ext[i] = '\0';
+    return 1;
+}
 
-    // Start the directory tree traversal from the given directory
-    if (nftw(get_directory(), collectFilePaths, 20, FTW_PHYS) == -1) {
-        // Failed to traverse directory tree
-        printf("error: failed to traverse directory tree\n");
-        return EXIT_FAILURE;
+struct ext_posting *ext_lookup(struct ext_index *index, const char *ext, int create) {
+    unsigned long hash = 5381;
+    for (const char *p = ext; *p != '\0'; p++) {
+        hash = hash * 33 + (unsigned char) *p;
+    }
+    struct ext_posting **bucket = &index->buckets[hash % EXT_BUCKETS];
+
+    for (struct ext_posting *posting = *bucket; posting != NULL; posting = posting->next) {
+        if (strcmp(posting->ext, ext) == 0) {
+            return posting;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    struct ext_posting *posting = calloc(1, sizeof(struct ext_posting));
+    if (posting == NULL) {
+        return NULL;
+    }
+    strcpy(posting->ext, ext);
+    posting->next = *bucket;
+    *bucket = posting;
+    index->extensions++;
+    return posting;
+}
+
+// first position in an ascending posting list whose entry is >= entry
+int posting_position(const int *entries, int count, int entry) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (entries[middle] < entry) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
     }
+    return low;
+}
 
-    if (file_count > 0) {
+int ext_insert(struct ext_index *index, const char *name, int entry, off_t size) {
+    char ext[MAX_EXTENSION_LENGTH + 1];
+    if (!file_extension(name, ext)) {
         return EXIT_SUCCESS;
-    } else {
+    }
+    struct ext_posting *posting = ext_lookup(index, ext, 1);
+    if (posting == NULL) {
         return EXIT_FAILURE;
     }
+
+    if (posting->count == posting->capacity) {
+        int capacity = posting->capacity == 0 ? 16 : posting->capacity * 2;
+        int *entries = realloc(posting->entries, capacity * sizeof(int));
+        if (entries == NULL) {
+            return EXIT_FAILURE;
+        }
+        posting->entries = entries;
+        posting->capacity = capacity;
+    }
+
+    // new files get the highest entry number, this is an append in the common case
+    int position = posting_position(posting->entries, posting->count, entry);
+    memmove(posting->entries + position + 1, posting->entries + position, (posting->count - position) * sizeof(int));
+    posting->entries[position] = entry;
+    posting->count++;
+    posting->bytes += size;
+    return EXIT_SUCCESS;
 }
 
-///////////////// cmd 4 END ///////////////////////////
+void ext_remove(struct ext_index *index, const char *name, int entry, off_t size) {
+    char ext[MAX_EXTENSION_LENGTH + 1];
+    struct ext_posting *posting;
+    if (!file_extension(name, ext) || (posting = ext_lookup(index, ext, 0)) == NULL) {
+        return;
+    }
 
-///////////////// cmd 5 START /////////////////////////
+    int position = posting_position(posting->entries, posting->count, entry);
+    if (position < posting->count && posting->entries[position] == entry) {
+        memmove(posting->entries + position, posting->entries + position + 1, (posting->count - position - 1) * sizeof(int));
+        posting->count--;
+        posting->bytes -= size;
+    }
+}
 
-int collectFilePathsByTypes(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    // check if it is a file
-    if (typeflag == FTW_F) {
-        // check if maximum number of file paths reached
-        if (file_count < MAX_FILE_PATHS) {
-            for (int i = 0; i < num_file_types; i++) {
-                // check if file extension matches any of the provided extensions
-                if (endswith(fpath, file_types[i]) == EXIT_SUCCESS) {
-                    // append the file path to the array
-                    strcpy(file_paths[file_count], fpath);
-                    file_count++;
-                    // return non-zero to stop traversal
-                    break;
-                }
-            }
-        } else {
-            // return non-zero to stop traversal
-            return 1;
+void ext_clear(struct ext_index *index) {
+    for (int i = 0; i < EXT_BUCKETS; i++) {
+        while (index->buckets[i] != NULL) {
+            struct ext_posting *next = index->buckets[i]->next;
+            free(index->buckets[i]->entries);
+            free(index->buckets[i]);
+            index->buckets[i] = next;
         }
     }
-    // continue traversal
-    return 0;
+    index->extensions = 0;
 }
 
-int create_file_list_on_file_types(char *file_types_str) {
-    const char *delimiters = " ";
-    char *fType = strtok(file_types_str, delimiters);
+//////////////////////////// EXTENSION INDEX END ///////////////////////////////////////
+
+//////////////////////////// TRIGRAM INDEX START ///////////////////////////////////////
+
+// every 3 byte substring of the indexed paths -> ascending posting list of the entries
+// containing it; a substring query intersects the lists of its trigrams and only
+// checks the candidates left, a name that is nowhere fails on a missing list
+struct trigram_posting {
+    unsigned int trigram;
+    int *entries;
+    int count;
+    int capacity;
+    struct trigram_posting *next; // same bucket
+};
+
+struct trigram_index {
+    struct trigram_posting *buckets[TRIGRAM_BUCKETS];
+    int trigrams;
+    long postings;
+};
+
+unsigned int trigram_at(const char *text) {
+    return (unsigned char) text[0] << 16 | (unsigned char) text[1] << 8 | (unsigned char) text[2];
+}
 
-    while (fType != NULL && num_file_types < MAX_FILE_TYPES) {
-        strcpy(file_types[num_file_types], fType);
-        num_file_types++;
-        fType = strtok(NULL, delimiters);
+struct trigram_posting *trigram_lookup(struct trigram_index *index, unsigned int trigram, int create) {
+    struct trigram_posting **bucket = &index->buckets[(trigram * 2654435761U >> 16) % TRIGRAM_BUCKETS];
+    for (struct trigram_posting *posting = *bucket; posting != NULL; posting = posting->next) {
+        if (posting->trigram == trigram) {
+            return posting;
+        }
     }
-
-    // Start the directory tree traversal from the given directory
-    if (nftw(get_directory(), collectFilePathsByTypes, 20, FTW_PHYS) == -1) {
-        // failed to traverse directory tree
-        printf("error: failed to traverse directory tree\n");
-        return EXIT_FAILURE;
+    if (!create) {
+        return NULL;
     }
 
-    if (file_count > 0) {
-        return EXIT_SUCCESS;
-    } else {
-        return EXIT_FAILURE;
+    struct trigram_posting *posting = calloc(1, sizeof(struct trigram_posting));
+    if (posting == NULL) {
+        return NULL;
     }
+    posting->trigram = trigram;
+    posting->next = *bucket;
+    *bucket = posting;
+    index->trigrams++;
+    return posting;
 }
 
-///////////////// cmd 5 END ///////////////////////////
+int compare_trigrams(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return x < y ? -1 : x > y;
+}
 
-///////////////// cmd 6 & 7 START /////////////////////
+// distinct trigrams of a text, returns how many; *trigrams is malloc'ed (NULL when none)
+int text_trigrams(const char *text, unsigned int **trigrams) {
+    size_t length = strlen(text);
+    *trigrams = NULL;
+    if (length < 3) {
+        return 0;
+    }
+    unsigned int *all = malloc((length - 2) * sizeof(unsigned int));
+    if (all == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i + 2 < length; i++) {
+        all[i] = trigram_at(text + i);
+    }
+    qsort(all, length - 2, sizeof(unsigned int), compare_trigrams);
 
-int collectFilePathsBeforeDate(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    // check if it is a file
-    if (typeflag == FTW_F) {
-        // check if maximum number of file paths reached
-        if (file_count < MAX_FILE_PATHS) {
-            // check if the file time - before_date_time is 0 or less
-            if (difftime(sb->st_mtime, before_date_time) <= 0) {
-                // Append the file path to the array
-                strcpy(file_paths[file_count], fpath);
-                file_count++;
-            }
-        } else {
-            // return non-zero to stop traversal
-            return 1;
+    int count = 0;
+    for (size_t i = 0; i < length - 2; i++) {
+        if (count == 0 || all[count - 1] != all[i]) {
+            all[count++] = all[i];
         }
     }
-    // continue traversal
-    return 0;
+    *trigrams = all;
+    return count;
 }
 
-int collectFilePathsAfterDate(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    // check if it is a file
-    if (typeflag == FTW_F) {
-        // check if maximum number of file paths reached
-        if (file_count < MAX_FILE_PATHS) {
-            // check if the file time - after_date_time is 0 or greater
-            if (difftime(sb->st_mtime, after_date_time) >= 0) {
-                // Append the file path to the array
-                strcpy(file_paths[file_count], fpath);
-                file_count++;
+int trigram_insert(struct trigram_index *index, const char *text, int entry) {
+    unsigned int *trigrams;
+    int count = text_trigrams(text, &trigrams);
+    int status = count < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    for (int t = 0; t < count; t++) {
+        struct trigram_posting *posting = trigram_lookup(index, trigrams[t], 1);
+        if (posting == NULL) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (posting->count == posting->capacity) {
+            int capacity = posting->capacity == 0 ? 4 : posting->capacity * 2;
+            int *entries = realloc(posting->entries, capacity * sizeof(int));
+            if (entries == NULL) {
+                status = EXIT_FAILURE;
+                break;
             }
+            posting->entries = entries;
+            posting->capacity = capacity;
+        }
+
+        // new files get the highest entry number, this is an append in the common case
+        int position = posting_position(posting->entries, posting->count, entry);
+        memmove(posting->entries + position + 1, posting->entries + position, (posting->count - position) * sizeof(int));
+        posting->entries[position] = entry;
+        posting->count++;
+        index->postings++;
+    }
+    free(trigrams);
+    return status;
+}
+
+void trigram_remove(struct trigram_index *index, const char *text, int entry) {
+    unsigned int *trigrams;
+    int count = text_trigrams(text, &trigrams);
+
+    for (int t = 0; t < count; t++) {
+        struct trigram_posting *posting = trigram_lookup(index, trigrams[t], 0);
+        if (posting == NULL) {
+            continue;
+        }
+        int position = posting_position(posting->entries, posting->count, entry);
+        if (position < posting->count && posting->entries[position] == entry) {
+            memmove(posting->entries + position, posting->entries + position + 1, (posting->count - position - 1) * sizeof(int));
+            posting->count--;
+            index->postings--;
+        }
+    }
+    free(trigrams);
+}
+
+void trigram_clear(struct trigram_index *index) {
+    for (int i = 0; i < TRIGRAM_BUCKETS; i++) {
+        while (index->buckets[i] != NULL) {
+            struct trigram_posting *next = index->buckets[i]->next;
+            free(index->buckets[i]->entries);
+            free(index->buckets[i]);
+            index->buckets[i] = next;
+        }
+    }
+    index->trigrams = 0;
+    index->postings = 0;
+}
+
+//////////////////////////// TRIGRAM INDEX END ///////////////////////////////////////
+
+//////////////////////////// TREE SCANNER START ///////////////////////////////////////
+
+// parallel walk of a directory tree with the semantics of nftw(..., FTW_PHYS) : symbolic
+// links are not followed or reported, unreadable directories and entries that cannot be
+// stat'ed are skipped. Directories are read with large getdents64() calls and their
+// entries stat'ed relative to the directory fd; every thread pops directories from its
+// own deque and steals from the others when it runs dry
+#define SCAN_DIRS_ONLY 1 // only report directories, other entries are not stat'ed
+
+// threads of a tree scan (-j)
+int scan_threads = 1;
+// index snapshot file (-i), empty : no snapshot
+char snapshot_path[MAX_PATH_LENGTH] = DEFAULT_SNAPSHOT_PATH;
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// directories waiting to be read; the owner works at the tail, thieves take from the head
+struct scan_deque {
+    pthread_mutex_t lock;
+    char **dirs;
+    int head;
+    int tail;
+    int capacity;
+};
+
+// visit() runs on the scan threads concurrently, it gets the path, the offset of the
+// base name, the lstat() result and the birth time (-1 if unknown); non zero stops the scan
+typedef int (*scan_visit)(const char *path, int name_offset, const struct stat *sb, time_t btime, void *arg);
+
+struct tree_scan {
+    struct scan_deque *deques;
+    int threads;
+    int flags;
+    long pending; // directories queued or being read
+    int stop;
+    scan_visit visit;
+    void *arg;
+};
+
+// queue dir (taken over) on the deque of thread self; EXIT_FAILURE stops the scan
+int scan_push(struct tree_scan *scan, int self, char *dir) {
+    struct scan_deque *deque = &scan->deques[self];
+    __atomic_add_fetch(&scan->pending, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->dirs, deque->dirs + deque->head, (deque->tail - deque->head) * sizeof(char *));
+            deque->tail -= deque->head;
+            deque->head = 0;
         } else {
-            // return non-zero to stop traversal
-            return 1;
+            int capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+            char **dirs = realloc(deque->dirs, capacity * sizeof(char *));
+            if (dirs == NULL) {
+                // the walk would be incomplete, scan_tree() fails
+                perror("error: allocating scan queue");
+                __atomic_store_n(&scan->stop, 1, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&deque->lock);
+                __atomic_sub_fetch(&scan->pending, 1, __ATOMIC_RELAXED);
+                free(dir);
+                return EXIT_FAILURE;
+            }
+            deque->dirs = dirs;
+            deque->capacity = capacity;
         }
     }
-    // continue traversal
+    deque->dirs[deque->tail++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+    return EXIT_SUCCESS;
+}
+
+// own deque : newest first (depth first, small deques); others : oldest first (big subtrees)
+char *scan_pop(struct tree_scan *scan, int self, int steal) {
+    struct scan_deque *deque = &scan->deques[self];
+    char *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        dir = steal ? deque->dirs[deque->head++] : deque->dirs[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+// fields the scans need : type, size and times for the index, type and mtime for the watcher
+#ifdef STATX_BTIME
+#define SCAN_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_BTIME)
+#define SCAN_DIRS_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_MTIME)
+
+void stat_from_statx(const struct statx *stx, struct stat *sb, time_t *btime) {
+    memset(sb, 0, sizeof(struct stat));
+    sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_ino = stx->stx_ino;
+    sb->st_mode = stx->stx_mode;
+    sb->st_nlink = stx->stx_nlink;
+    sb->st_uid = stx->stx_uid;
+    sb->st_gid = stx->stx_gid;
+    sb->st_size = stx->stx_size;
+    sb->st_blksize = stx->stx_blksize;
+    sb->st_blocks = stx->stx_blocks;
+    sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    *btime = (stx->stx_mask & STATX_BTIME) ? stx->stx_btime.tv_sec : -1;
+}
+#endif
+
+// lstat() relative to a directory fd, with the birth time when statx() has it
+int scan_stat(int dir_fd, const char *name, int flags, struct stat *sb, time_t *btime) {
+    *btime = -1;
+#ifdef STATX_BTIME
+    struct statx stx;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+              (flags & SCAN_DIRS_ONLY) ? SCAN_DIRS_STATX_MASK : SCAN_STATX_MASK, &stx) < 0) {
+        return -1;
+    }
+    stat_from_statx(&stx, sb, btime);
     return 0;
+#else
+    return fstatat(dir_fd, name, sb, AT_SYMLINK_NOFOLLOW);
+#endif
 }
 
-// create file list based on provided date and type of comparison
-// type -> 1 : before or equal, 2 : after or equal
-int create_file_list_on_date(char *date_str, int type) {
-    struct tm date_tm;
-    memset(&date_tm, 0, sizeof(struct tm));
-    if (strptime(date_str, "%Y-%m-%d", &date_tm) == NULL) {
-        fprintf(stderr, "error : parsing date string: %s\n", date_str);
-        return EXIT_FAILURE;
+// the entries of a directory are stat'ed in batches of up to SCAN_BATCH, with one
+// io_uring_enter() per batch where the kernel has io_uring, one statx() each otherwise
+#define SCAN_BATCH 256
+
+#if defined(__NR_io_uring_setup) && defined(STATX_BTIME)
+#define SCAN_IO_URING 1
+
+struct scan_ring {
+    int fd; // -1 : not available, stat synchronously
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+void scan_ring_close(struct scan_ring *ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
     }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
 
-    if(type == 1) {
-        // convert before_date_tm to time_t
-        before_date_time = mktime(&date_tm);
-    } else {
-        // convert before_date_tm to time_t
-        after_date_time = mktime(&date_tm);
+int scan_ring_submit(struct scan_ring *ring, int dir_fd, const char **names, int count, unsigned int mask,
+                     struct statx *results, int *status);
+
+int scan_ring_open(struct scan_ring *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(struct scan_ring));
+    ring->fd = syscall(__NR_io_uring_setup, SCAN_BATCH, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return EXIT_FAILURE;
     }
 
-    if(type == 1) {
-        // start the directory tree traversal from the given directory
-        if (nftw(get_directory(), collectFilePathsBeforeDate, 20, FTW_PHYS) == -1) {
-            // failed to traverse directory tree
-            printf("error: failed to traverse directory tree\n");
-            return EXIT_FAILURE;
-        }
-    } else {
-        // start the directory tree traversal from the given directory
-        if (nftw(get_directory(), collectFilePathsAfterDate, 20, FTW_PHYS) == -1) {
-            // failed to traverse directory tree
-            printf("error: failed to traverse directory tree\n");
-            return EXIT_FAILURE;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
         }
+        ring->cq_ring_size = ring->sq_ring_size;
     }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
 
-    if (file_count > 0) {
-        return EXIT_SUCCESS;
-    } else {
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        ring->fd = -1;
         return EXIT_FAILURE;
     }
-}
 
-///////////////// cmd 6 & 7 END ////////////////////////
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // kernels before 5.6 reject the opcode
+    const char *name = ".";
+    struct statx probe;
+    int status;
+    if (scan_ring_submit(ring, AT_FDCWD, &name, 1, STATX_TYPE, &probe, &status) == EXIT_FAILURE || status < 0) {
+        scan_ring_close(ring);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-// create a tar file with the provided name
-// with the files from -> file_paths
-// number of files -> file_count
-int create_tar_gz_v2(char *file_name) {
-    //TODO remove DEBUG
-    if (file_count > 0) {
-        printf("file(s) found : %d\n", file_count);
+// statx() of count names relative to dir_fd (count <= SCAN_BATCH); status[i] is 0 or -errno
+int scan_ring_submit(struct scan_ring *ring, int dir_fd, const char **names, int count, unsigned int mask,
+                     struct statx *results, int *status) {
+    unsigned tail = *ring->sq_tail;
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dir_fd;
+        sqe->addr = (uintptr_t) names[i];
+        sqe->len = mask;
+        sqe->off = (uintptr_t) &results[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+        sqe->user_data = i;
+        ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
 
-//        for (int i = 0; i < file_count; i++) {
-//            printf("%s\n", file_paths[i]);
-//        }
-    } else {
-        printf("No file found\n");
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, count, count, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted < 0) {
+        // nothing was consumed, take the entries back
+        __atomic_store_n(ring->sq_tail, tail - count, __ATOMIC_RELEASE);
+        return EXIT_FAILURE;
     }
 
-    char *cmd_base = "tar -czf ";
+    for (int done = 0; done < submitted;) {
+        unsigned head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, ring->fd, 0, submitted - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        status[cqe->user_data] = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        done++;
+    }
+    return submitted == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
+// per thread state of a scan
+struct scan_thread {
+    struct tree_scan *scan;
+    int self;
+    pthread_t thread;
+    char *buffer; // getdents64()
+    const char *names[SCAN_BATCH];
+#ifdef SCAN_IO_URING
+    struct scan_ring ring;
+    struct statx results[SCAN_BATCH];
+    int status[SCAN_BATCH];
+#endif
+};
+
+// stat a batch of entries of one directory, report them and queue the subdirectories
+int scan_batch(struct scan_thread *thread, int fd, const char *path, int count) {
+    struct tree_scan *scan = thread->scan;
+    size_t path_length = strlen(path);
+    char child[MAX_PATH_LENGTH];
+
+#ifdef SCAN_IO_URING
+    if (thread->ring.fd >= 0 &&
+        scan_ring_submit(&thread->ring, fd, thread->names, count,
+                         (scan->flags & SCAN_DIRS_ONLY) ? SCAN_DIRS_STATX_MASK : SCAN_STATX_MASK,
+                         thread->results, thread->status) == EXIT_FAILURE) {
+        // the ring is in an unknown state, the rest of the scan stats synchronously
+        scan_ring_close(&thread->ring);
+    }
+#endif
+
+    for (int i = 0; i < count; i++) {
+        struct stat sb;
+        time_t btime;
+#ifdef SCAN_IO_URING
+        if (thread->ring.fd >= 0) {
+            if (thread->status[i] < 0) {
+                continue;
+            }
+            stat_from_statx(&thread->results[i], &sb, &btime);
+        } else
+#endif
+        if (scan_stat(fd, thread->names[i], scan->flags, &sb, &btime) < 0) {
+            continue;
+        }
+        if (S_ISLNK(sb.st_mode) || ((scan->flags & SCAN_DIRS_ONLY) && !S_ISDIR(sb.st_mode))) {
+            continue;
+        }
+
+        sprintf(child, "%s/%s", path, thread->names[i]);
+        // directories are reported before their entries, like FTW_D
+        if (scan->visit(child, path_length + 1, &sb, btime, scan->arg) != 0) {
+            __atomic_store_n(&scan->stop, 1, __ATOMIC_RELAXED);
+            return EXIT_FAILURE;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            // a directory left out would leave the walk incomplete, scan_tree() fails
+            char *dir = strdup(child);
+            if (dir == NULL) {
+                perror("error: allocating scan queue");
+                __atomic_store_n(&scan->stop, 1, __ATOMIC_RELAXED);
+                return EXIT_FAILURE;
+            }
+            if (scan_push(scan, thread->self, dir) == EXIT_FAILURE) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// read one directory with getdents64(), its entries are stat'ed a batch at a time
+void scan_directory(struct scan_thread *thread, const char *path) {
+    struct tree_scan *scan = thread->scan;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    size_t path_length = strlen(path);
+    long n;
+    while (!__atomic_load_n(&scan->stop, __ATOMIC_RELAXED) && (n = syscall(SYS_getdents64, fd, thread->buffer, SCAN_BUFFER_SIZE)) > 0) {
+        // the names stay in the buffer until the batches of this read are done
+        int count = 0;
+        for (long offset = 0; offset < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (thread->buffer + offset);
+            offset += d->d_reclen;
+
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 ||
+                ((scan->flags & SCAN_DIRS_ONLY) && d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) ||
+                path_length + 1 + strlen(d->d_name) >= MAX_PATH_LENGTH) {
+                continue;
+            }
+            thread->names[count++] = d->d_name;
+            if (count == SCAN_BATCH) {
+                int status = scan_batch(thread, fd, path, count);
+                count = 0;
+                if (status == EXIT_FAILURE) {
+                    break;
+                }
+            }
+        }
+        if (count > 0) {
+            scan_batch(thread, fd, path, count);
+        }
+    }
+    close(fd);
+}
+
+void *scan_thread_main(void *arg) {
+    struct scan_thread *thread = arg;
+    struct tree_scan *scan = thread->scan;
+    if ((thread->buffer = malloc(SCAN_BUFFER_SIZE)) == NULL) {
+        return NULL;
+    }
+#ifdef SCAN_IO_URING
+    scan_ring_open(&thread->ring);
+#endif
+
+    int idle = 0;
+    while (!__atomic_load_n(&scan->stop, __ATOMIC_RELAXED)) {
+        char *dir = scan_pop(scan, thread->self, 0);
+        for (int i = 1; dir == NULL && i < scan->threads; i++) {
+            dir = scan_pop(scan, (thread->self + i) % scan->threads, 1);
+        }
+
+        if (dir == NULL) {
+            // nothing queued anywhere; done once no thread is reading a directory either
+            if (__atomic_load_n(&scan->pending, __ATOMIC_ACQUIRE) == 0) {
+                break;
+            }
+            if (++idle < 64) {
+                sched_yield();
+            } else {
+                usleep(100);
+            }
+            continue;
+        }
+        idle = 0;
+        scan_directory(thread, dir);
+        free(dir);
+        __atomic_sub_fetch(&scan->pending, 1, __ATOMIC_RELEASE);
+    }
+
+#ifdef SCAN_IO_URING
+    scan_ring_close(&thread->ring);
+#endif
+    free(thread->buffer);
+    return NULL;
+}
+
+// walk the tree below root on `threads` threads, root itself is reported first;
+// returns EXIT_FAILURE when root cannot be read, visit() stopped the scan or the
+// walk ran out of memory
+int scan_tree(const char *root, int threads, int flags, scan_visit visit, void *arg) {
+    struct stat sb;
+    time_t btime;
+    if (scan_stat(AT_FDCWD, root, flags, &sb, &btime) < 0) {
+        return EXIT_FAILURE;
+    }
+    const char *slash = strrchr(root, '/');
+    int name_offset = slash == NULL ? 0 : slash - root + 1;
+    if (!S_ISDIR(sb.st_mode)) {
+        return S_ISLNK(sb.st_mode) || (flags & SCAN_DIRS_ONLY) || visit(root, name_offset, &sb, btime, arg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (visit(root, name_offset, &sb, btime, arg) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct tree_scan scan = {NULL, threads < 1 ? 1 : threads, flags, 0, 0, visit, arg};
+    struct scan_thread *pool_threads = calloc(scan.threads, sizeof(struct scan_thread));
+    scan.deques = calloc(scan.threads, sizeof(struct scan_deque));
+    char *first = strdup(root);
+    if (pool_threads == NULL || scan.deques == NULL || first == NULL) {
+        free(pool_threads);
+        free(scan.deques);
+        free(first);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < scan.threads; i++) {
+        pthread_mutex_init(&scan.deques[i].lock, NULL);
+    }
+    scan_push(&scan, 0, first);
+
+    // the calling thread is scan thread 0
+    pool_threads[0].scan = &scan;
+    int started = 1;
+    for (; started < scan.threads; started++) {
+        pool_threads[started].scan = &scan;
+        pool_threads[started].self = started;
+        if (pthread_create(&pool_threads[started].thread, NULL, scan_thread_main, &pool_threads[started]) != 0) {
+            break;
+        }
+    }
+    scan_thread_main(&pool_threads[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(pool_threads[i].thread, NULL);
+    }
+
+    // left over after a stop
+    for (int i = 0; i < scan.threads; i++) {
+        char *dir;
+        while ((dir = scan_pop(&scan, i, 0)) != NULL) {
+            free(dir);
+        }
+        free(scan.deques[i].dirs);
+        pthread_mutex_destroy(&scan.deques[i].lock);
+    }
+    free(scan.deques);
+    free(pool_threads);
+    return scan.stop ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//////////////////////////// TREE SCANNER END ///////////////////////////////////////
+
+//////////////////////////// FILE INDEX START ///////////////////////////////////////
+
+// metadata of every file under the export directory, collected once at startup
+// and kept current by the file watcher; held by the index writer only, which
+// publishes it to the other processes as a shared image (SHARED INDEX)
+struct index_entry {
+    char *path; // NULL once the file is gone, the slot is reused by index_compact()
+    const char *name; // base name, points into path
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    time_t btime; // birth time from statx(), -1 where the file system does not keep it
+    mode_t mode;
+    int hash_next; // next entry in the same path bucket, -1 at the end
+    unsigned int seen; // last directory rescan that found the file
+};
+
+struct file_index {
+    pthread_rwlock_t lock;
+    struct index_entry *entries; // in path order then creation order, the order the searches report
+    int count;
+    int capacity;
+    int live;
+    int *buckets; // path hash -> first entry, -1 when empty
+    int bucket_count;
+    int ready; // the startup walk succeeded
+    struct timespec built_at;
+
+    // secondary indexes, maintained once the startup walk has loaded them
+    int secondary;
+    unsigned long changes; // files added, removed or changed, for the periodic snapshot
+    int from_snapshot; // loaded from a snapshot, file metadata is re-checked in the background
+    struct ordered_index ordered[ORDERED_KEYS]; // KEY_SIZE, KEY_MTIME, ...
+    struct ext_index by_ext;
+    struct trigram_index by_trigram; // over the paths below the export directory and the last two bytes of it
+};
+
+// everything but the lock starts zeroed
+struct file_index file_index = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+// key of an entry in one of the ordered indexes, -1 : not in that index
+int64_t entry_key(const struct index_entry *e, int key) {
+    if (key == KEY_SIZE) {
+        return e->size;
+    }
+    if (key == KEY_MTIME) {
+        return e->mtime;
+    }
+    if (key == KEY_CTIME) {
+        return e->ctime;
+    }
+    return e->btime;
+}
+
+// the part of a path in the trigram index : the export directory prefix is shared by every
+// entry, its last two bytes are kept for the trigrams that run into the relative path
+const char *trigram_text(const char *path) {
+    static size_t root_length = 0;
+    if (root_length == 0) {
+        root_length = strlen(get_directory());
+    }
+    return path + root_length - 2;
+}
+
+// bytes at the start of name left out of its trigrams : a match that starts inside the
+// export directory prefix has the rest of name after the last two indexed bytes of it.
+// Fewer than 3 bytes left (a name inside the prefix) : no trigrams, name is scanned for
+size_t root_skip(const char *name) {
+    const char *root = get_directory();
+    size_t root_length = strlen(root);
+    size_t name_length = strlen(name);
+    for (size_t p = 0; p + 2 < root_length; p++) {
+        size_t overlap = root_length - p < name_length ? root_length - p : name_length;
+        if (strncmp(root + p, name, overlap) == 0) {
+            // the earliest start leaves the shortest rest
+            size_t skip = root_length - 2 - p;
+            return skip < name_length ? skip : name_length;
+        }
+    }
+    return 0;
+}
+
+// bulk load the secondary indexes from the live entries (startup, compaction)
+int index_build_secondary() {
+    struct ordered_item *items = malloc((file_index.live + 1) * sizeof(struct ordered_item));
+    if (items == NULL) {
+        file_index.secondary = 0;
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int key = 0; key < ORDERED_KEYS; key++) {
+        long count = 0;
+        for (int i = 0; i < file_index.count; i++) {
+            struct index_entry *e = &file_index.entries[i];
+            if (e->path != NULL && (key != KEY_BTIME || e->btime >= 0)) {
+                items[count].key = entry_key(e, key);
+                items[count].entry = i;
+                count++;
+            }
+        }
+        if (ordered_build(&file_index.ordered[key], items, count) == EXIT_FAILURE) {
+            status = EXIT_FAILURE;
+        }
+    }
+    free(items);
+
+    ext_clear(&file_index.by_ext);
+    trigram_clear(&file_index.by_trigram);
+    for (int i = 0; i < file_index.count; i++) {
+        struct index_entry *e = &file_index.entries[i];
+        if (e->path != NULL && (ext_insert(&file_index.by_ext, e->name, i, e->size) == EXIT_FAILURE ||
+                                trigram_insert(&file_index.by_trigram, trigram_text(e->path), i) == EXIT_FAILURE)) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    file_index.secondary = status == EXIT_SUCCESS;
+    return status;
+}
+
+// keep the secondary indexes in step with one entry, the write lock is held
+void index_secondary_add(int i) {
+    struct index_entry *e = &file_index.entries[i];
+    if (file_index.secondary) {
+        for (int key = 0; key < ORDERED_KEYS; key++) {
+            if (key != KEY_BTIME || e->btime >= 0) {
+                ordered_insert(&file_index.ordered[key], entry_key(e, key), i);
+            }
+        }
+        ext_insert(&file_index.by_ext, e->name, i, e->size);
+    }
+}
+
+void index_secondary_remove(int i) {
+    struct index_entry *e = &file_index.entries[i];
+    if (file_index.secondary) {
+        for (int key = 0; key < ORDERED_KEYS; key++) {
+            if (key != KEY_BTIME || e->btime >= 0) {
+                ordered_remove(&file_index.ordered[key], entry_key(e, key), i);
+            }
+        }
+        ext_remove(&file_index.by_ext, e->name, i, e->size);
+    }
+}
+
+unsigned long path_hash_length(const char *path, size_t length) {
+    unsigned long hash = 0xcbf29ce484222325UL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) path[i]) * 0x100000001b3UL;
+    }
+    return hash;
+}
+
+unsigned long path_hash(const char *path) {
+    return path_hash_length(path, strlen(path));
+}
+
+// rebuild the path buckets for the live entries, the write lock is held
+int index_rehash(int bucket_count) {
+    int *buckets = malloc(bucket_count * sizeof(int));
+    if (buckets == NULL) {
+        return EXIT_FAILURE;
+    }
+    memset(buckets, -1, bucket_count * sizeof(int));
+
+    for (int i = 0; i < file_index.count; i++) {
+        struct index_entry *e = &file_index.entries[i];
+        if (e->path != NULL) {
+            unsigned long bucket = path_hash(e->path) & (bucket_count - 1);
+            e->hash_next = buckets[bucket];
+            buckets[bucket] = i;
+        }
+    }
+
+    free(file_index.buckets);
+    file_index.buckets = buckets;
+    file_index.bucket_count = bucket_count;
+    return EXIT_SUCCESS;
+}
+
+int index_find(const char *path) {
+    if (file_index.bucket_count == 0) {
+        return -1;
+    }
+    int i = file_index.buckets[path_hash(path) & (file_index.bucket_count - 1)];
+    while (i >= 0 && strcmp(file_index.entries[i].path, path) != 0) {
+        i = file_index.entries[i].hash_next;
+    }
+    return i;
+}
+
+// creation time where the kernel and file system report one
+time_t birth_time(const char *path) {
+#ifdef STATX_BTIME
+    struct statx stx;
+    if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_BTIME, &stx) == 0 && (stx.stx_mask & STATX_BTIME)) {
+        return stx.stx_btime.tv_sec;
+    }
+#endif
+    return -1;
+}
+
+void index_set_metadata(struct index_entry *e, const struct stat *sb, time_t btime) {
+    e->size = sb->st_size;
+    e->mtime = sb->st_mtime;
+    e->ctime = sb->st_ctime;
+    e->btime = btime;
+    e->mode = sb->st_mode;
+}
+
+// append a file, the write lock is held (or the index is not shared yet)
+int index_add(const char *path, int name_offset, const struct stat *sb, time_t btime) {
+    if (file_index.count == file_index.capacity) {
+        int capacity = file_index.capacity == 0 ? 1024 : file_index.capacity * 2;
+        struct index_entry *entries = realloc(file_index.entries, capacity * sizeof(struct index_entry));
+        if (entries == NULL) {
+            return EXIT_FAILURE;
+        }
+        file_index.entries = entries;
+        file_index.capacity = capacity;
+    }
+
+    struct index_entry *e = &file_index.entries[file_index.count];
+    if ((e->path = strdup(path)) == NULL) {
+        return EXIT_FAILURE;
+    }
+    e->name = e->path + name_offset;
+    e->seen = 0;
+    index_set_metadata(e, sb, btime);
+    file_index.count++;
+    file_index.live++;
+    file_index.changes++;
+
+    index_secondary_add(file_index.count - 1);
+    // the path never changes, unlike the keys of the other secondary indexes
+    if (file_index.secondary) {
+        trigram_insert(&file_index.by_trigram, trigram_text(e->path), file_index.count - 1);
+    }
+
+    // keep the buckets at most half full
+    if (file_index.live * 2 > file_index.bucket_count) {
+        return index_rehash(file_index.bucket_count == 0 ? 4096 : file_index.bucket_count * 2);
+    }
+    unsigned long bucket = path_hash(e->path) & (file_index.bucket_count - 1);
+    e->hash_next = file_index.buckets[bucket];
+    file_index.buckets[bucket] = file_index.count - 1;
+    return EXIT_SUCCESS;
+}
+
+// squeeze out removed entries, the order of the rest is kept
+void index_compact() {
+    int live = 0;
+    for (int i = 0; i < file_index.count; i++) {
+        if (file_index.entries[i].path != NULL) {
+            file_index.entries[live++] = file_index.entries[i];
+        }
+    }
+    file_index.count = live;
+    index_rehash(file_index.bucket_count);
+    // entry numbers moved
+    index_build_secondary();
+}
+
+void index_remove(int i) {
+    struct index_entry *e = &file_index.entries[i];
+    int *link = &file_index.buckets[path_hash(e->path) & (file_index.bucket_count - 1)];
+    while (*link != i) {
+        link = &file_index.entries[*link].hash_next;
+    }
+    *link = e->hash_next;
+
+    index_secondary_remove(i);
+    if (file_index.secondary) {
+        trigram_remove(&file_index.by_trigram, trigram_text(e->path), i);
+    }
+    free(e->path);
+    e->path = NULL;
+    file_index.live--;
+    file_index.changes++;
+}
+
+// release the write lock; removed entries are squeezed out here, once more than half of
+// the slots are empty, as the callers walk the entries by number while they remove
+void index_write_unlock() {
+    // entry numbers must stay put while a snapshot is loaded, see load_file_index()
+    if (file_index.secondary && file_index.count > 1024 && file_index.live < file_index.count / 2) {
+        index_compact();
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+}
+
+// add, refresh or drop one path after a change, the write lock is held
+void index_update_path(const char *path, const struct stat *sb) {
+    int i = index_find(path);
+
+    if (sb == NULL || S_ISDIR(sb->st_mode) || S_ISLNK(sb->st_mode)) {
+        // gone, or not something the scanner indexes
+        if (i >= 0) {
+            index_remove(i);
+        }
+    } else if (i >= 0) {
+        struct index_entry *e = &file_index.entries[i];
+        if (e->size != sb->st_size || e->mtime != sb->st_mtime || e->ctime != sb->st_ctime) {
+            index_secondary_remove(i);
+            index_set_metadata(e, sb, birth_time(path));
+            index_secondary_add(i);
+            file_index.changes++;
+        } else {
+            index_set_metadata(e, sb, e->btime);
+        }
+    } else {
+        const char *slash = strrchr(path, '/');
+        index_add(path, slash == NULL ? 0 : slash - path + 1, sb, birth_time(path));
+    }
+}
+
+// drop the files of a failed startup walk, the secondary indexes are not built yet
+void index_clear() {
+    for (int i = 0; i < file_index.count; i++) {
+        free(file_index.entries[i].path);
+    }
+    file_index.count = 0;
+    file_index.live = 0;
+    free(file_index.buckets);
+    file_index.buckets = NULL;
+    file_index.bucket_count = 0;
+}
+
+// drop every file below a removed or moved directory, the write lock is held
+void index_remove_subtree(const char *dir) {
+    size_t length = strlen(dir);
+    for (int i = 0; i < file_index.count; i++) {
+        char *path = file_index.entries[i].path;
+        if (path != NULL && strncmp(path, dir, length) == 0 && path[length] == '/') {
+            index_remove(i);
+        }
+    }
+}
+
+// directories of the export tree with their mtime when a walk read them, saved with
+// the index and compared with the tree when the snapshot is loaded again
+struct dir_record {
+    char *path;
+    struct timespec mtime;
+    struct timespec ctime; // with the inode, only from a walk (not kept in the snapshot)
+    ino_t ino;
+    int changed; // new or modified since the snapshot or the last poll, DIR_GONE : removed
+};
+
+#define DIR_GONE 2
+
+struct dir_list {
+    pthread_mutex_t lock;
+    struct dir_record *dirs;
+    int count;
+    int capacity;
+    int *slots; // path hash -> dir, -1 when empty, see dir_list_index()
+    int slot_count;
+};
+
+// sb : the directory as it was when its entries were read
+int dir_list_add(struct dir_list *list, const char *path, const struct stat *sb) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        struct dir_record *dirs = realloc(list->dirs, capacity * sizeof(struct dir_record));
+        if (dirs == NULL) {
+            return EXIT_FAILURE;
+        }
+        list->dirs = dirs;
+        list->capacity = capacity;
+    }
+    struct dir_record *dir = &list->dirs[list->count];
+    if ((dir->path = strdup(path)) == NULL) {
+        return EXIT_FAILURE;
+    }
+    dir->mtime = sb->st_mtim;
+    dir->ctime = sb->st_ctim;
+    dir->ino = sb->st_ino;
+    dir->changed = 0;
+    list->count++;
+    return EXIT_SUCCESS;
+}
+
+void dir_list_free(struct dir_list *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->dirs[i].path);
+    }
+    free(list->dirs);
+    free(list->slots);
+    list->dirs = NULL;
+    list->slots = NULL;
+    list->count = list->capacity = list->slot_count = 0;
+}
+
+// open addressing table over the paths, once the list is complete
+int dir_list_index(struct dir_list *list) {
+    int slot_count = 64;
+    while (slot_count < list->count * 2) {
+        slot_count *= 2;
+    }
+    free(list->slots);
+    if ((list->slots = malloc(slot_count * sizeof(int))) == NULL) {
+        return EXIT_FAILURE;
+    }
+    memset(list->slots, -1, slot_count * sizeof(int));
+    list->slot_count = slot_count;
+
+    for (int i = 0; i < list->count; i++) {
+        unsigned long slot = path_hash(list->dirs[i].path) & (slot_count - 1);
+        while (list->slots[slot] >= 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        list->slots[slot] = i;
+    }
+    return EXIT_SUCCESS;
+}
+
+// the directory with the first `length` bytes of path as its path, -1 if there is none
+int dir_list_find(const struct dir_list *list, const char *path, size_t length) {
+    unsigned long slot = path_hash_length(path, length) & (list->slot_count - 1);
+    for (; list->slots[slot] >= 0; slot = (slot + 1) & (list->slot_count - 1)) {
+        const char *dir = list->dirs[list->slots[slot]].path;
+        if (strncmp(dir, path, length) == 0 && dir[length] == '\0') {
+            return list->slots[slot];
+        }
+    }
+    return -1;
+}
+
+// runs on the scan threads, files go to the index and directories to the dir_list in arg
+int indexFile(const char *fpath, int name_offset, const struct stat *sb, time_t btime, void *arg) {
+    struct dir_list *dirs = arg;
+    pthread_mutex_lock(&dirs->lock);
+    int status = S_ISDIR(sb->st_mode) ? dir_list_add(dirs, fpath, sb) : index_add(fpath, name_offset, sb, btime);
+    pthread_mutex_unlock(&dirs->lock);
+    if (status == EXIT_FAILURE) {
+        perror("error: indexing file");
+        return 1;
+    }
+    return 0;
+}
+
+// runs on the scan threads, directories only
+int recordDirectory(const char *fpath, int name_offset, const struct stat *sb, time_t btime, void *arg) {
+    (void) name_offset;
+    (void) btime;
+    struct dir_list *dirs = arg;
+    pthread_mutex_lock(&dirs->lock);
+    int status = dir_list_add(dirs, fpath, sb);
+    pthread_mutex_unlock(&dirs->lock);
+    return status == EXIT_FAILURE;
+}
+
+int compare_entries_by_path(const void *a, const void *b) {
+    return strcmp(((const struct index_entry *) a)->path, ((const struct index_entry *) b)->path);
+}
+
+// walk the export directory once, on the index writer's thread; the directories
+// are collected in dirs for the snapshot
+int build_file_index(struct dir_list *dirs) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_rwlock_wrlock(&file_index.lock);
+    // changes from here on are caught up by the watcher through the directory mtimes
+    clock_gettime(CLOCK_REALTIME, &file_index.built_at);
+    if (scan_tree(get_directory(), scan_threads, 0, indexFile, dirs) != EXIT_SUCCESS) {
+        // nothing of an incomplete walk is kept, the caller tries again
+        index_clear();
+        dir_list_free(dirs);
+        pthread_rwlock_unlock(&file_index.lock);
+        fprintf(stderr, "error: failed to index %s\n", get_directory());
+        return EXIT_FAILURE;
+    }
+    // the scan threads add files in no particular order
+    qsort(file_index.entries, file_index.count, sizeof(struct index_entry), compare_entries_by_path);
+    index_rehash(file_index.bucket_count);
+    file_index.ready = 1;
+    index_build_secondary();
+    pthread_rwlock_unlock(&file_index.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("indexed %d files in %.1f ms (%d scan threads)\n", file_index.count,
+           (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0, scan_threads);
+    return EXIT_SUCCESS;
+}
+
+//////////////////////////// FILE INDEX END ///////////////////////////////////////
+
+//////////////////////////// FILE WATCHER START ///////////////////////////////////////
+
+// inotify watch on every directory of the export tree, events are applied to the
+// index as they arrive; after a queue overflow only directories whose mtime moved
+// are read again. Without inotify (or with -p) the directories are polled instead
+struct watch_dir {
+    char *path;
+    struct timespec mtime; // when its entries were last read
+};
+
+struct file_watcher {
+    int fd;
+    struct watch_dir *dirs; // indexed by watch descriptor
+    int capacity;
+    unsigned int scan; // id of the current directory rescan
+    int failed; // a directory could not be watched, the tree is polled instead
+};
+
+struct file_watcher watcher = {-1, NULL, 0, 0, 0};
+
+// -p : poll the directories every poll_interval seconds instead of watching them
+int poll_interval = 0;
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+
+// returns 1 for a new watch, 0 if the directory is watched already, -1 on errors
+int watch_directory(const char *path, const struct stat *sb) {
+    int wd = inotify_add_watch(watcher.fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        if (!watcher.failed++) {
+            fprintf(stderr, "error: watching %s : %s (raise fs.inotify.max_user_watches), polling instead\n", path, strerror(errno));
+        }
+        return -1;
+    }
+
+    if (wd >= watcher.capacity) {
+        int capacity = watcher.capacity == 0 ? 1024 : watcher.capacity;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        struct watch_dir *dirs = realloc(watcher.dirs, capacity * sizeof(struct watch_dir));
+        if (dirs == NULL) {
+            inotify_rm_watch(watcher.fd, wd);
+            return -1;
+        }
+        memset(dirs + watcher.capacity, 0, (capacity - watcher.capacity) * sizeof(struct watch_dir));
+        watcher.dirs = dirs;
+        watcher.capacity = capacity;
+    }
+
+    struct watch_dir *dir = &watcher.dirs[wd];
+    if (dir->path != NULL && strcmp(dir->path, path) == 0) {
+        return 0;
+    }
+    free(dir->path);
+    dir->path = strdup(path);
+    dir->mtime = sb->st_mtim;
+    return 1;
+}
+
+// stop watching a removed or moved directory and everything below it
+void unwatch_subtree(const char *path) {
+    size_t length = strlen(path);
+    for (int wd = 0; wd < watcher.capacity; wd++) {
+        char *dir = watcher.dirs[wd].path;
+        if (dir != NULL && strncmp(dir, path, length) == 0 && (dir[length] == '\0' || dir[length] == '/')) {
+            inotify_rm_watch(watcher.fd, wd);
+            free(dir);
+            watcher.dirs[wd].path = NULL;
+        }
+    }
+}
+
+void rescan_directory(const char *path, int sweep);
+
+// read the files of a directory into the index, new subdirectories are watched and read too;
+// sweep : drop indexed files of the directory that are not there anymore
+void rescan_directory(const char *path, int sweep) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+
+    unsigned int scan = ++watcher.scan;
+    char **subdirs = NULL;
+    int subdir_count = 0;
+    int rewalk = 0;
+    char child[MAX_PATH_LENGTH];
+
+    pthread_rwlock_wrlock(&file_index.lock);
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            snprintf(child, sizeof(child), "%s/%s", path, d->d_name) >= (int) sizeof(child)) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            // read outside the lock, after this directory is done; without a watcher
+            // (loading a snapshot) new directories are found by the directory walk
+            if (watcher.fd >= 0 && watch_directory(child, &st) == 1 && !rewalk) {
+                char *copy = strdup(child);
+                char **grown = copy == NULL ? NULL : realloc(subdirs, (subdir_count + 1) * sizeof(char *));
+                if (grown == NULL) {
+                    // out of memory : every subdirectory is read again once this one is done
+                    free(copy);
+                    rewalk = 1;
+                } else {
+                    subdirs = grown;
+                    subdirs[subdir_count++] = copy;
+                }
+            }
+        } else {
+            index_update_path(child, &st);
+            int i = index_find(child);
+            if (i >= 0) {
+                file_index.entries[i].seen = scan;
+            }
+        }
+    }
+
+    if (sweep) {
+        size_t length = strlen(path);
+        for (int i = 0; i < file_index.count; i++) {
+            struct index_entry *e = &file_index.entries[i];
+            if (e->path != NULL && e->seen != scan && (size_t) (e->name - e->path) == length + 1 &&
+                strncmp(e->path, path, length) == 0) {
+                index_remove(i);
+            }
+        }
+    }
+    index_write_unlock();
+
+    if (rewalk) {
+        // the new subdirectories are not all known, read every one
+        rewinddir(dir);
+        while ((d = readdir(dir)) != NULL) {
+            struct stat st;
+            if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0 &&
+                fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode) &&
+                snprintf(child, sizeof(child), "%s/%s", path, d->d_name) < (int) sizeof(child)) {
+                rescan_directory(child, 1);
+            }
+        }
+    }
+    closedir(dir);
+
+    for (int i = 0; i < subdir_count; i++) {
+        if (!rewalk) {
+            rescan_directory(subdirs[i], 0);
+        }
+        free(subdirs[i]);
+    }
+    free(subdirs);
+}
+
+// a directory showed up (created, moved in) : watch and index it with everything below
+void add_directory(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && watch_directory(path, &st) >= 0) {
+        rescan_directory(path, 1);
+    }
+}
+
+// directories modified since the index was built, collected while the watches are set up
+struct watch_setup {
+    pthread_mutex_t lock;
+    char **changed;
+    int count;
+};
+
+// set up the watches of the tree, runs on the scan threads
+int watchDirectory(const char *fpath, int name_offset, const struct stat *sb, time_t btime, void *arg) {
+    (void) name_offset;
+    (void) btime;
+    struct watch_setup *setup = arg;
+    struct timespec built = file_index.built_at;
+    pthread_mutex_lock(&setup->lock);
+    if (watch_directory(fpath, sb) >= 0 &&
+        (sb->st_mtim.tv_sec > built.tv_sec || (sb->st_mtim.tv_sec == built.tv_sec && sb->st_mtim.tv_nsec >= built.tv_nsec))) {
+        char **grown = realloc(setup->changed, (setup->count + 1) * sizeof(char *));
+        if (grown != NULL) {
+            setup->changed = grown;
+            setup->changed[setup->count++] = strdup(fpath);
+        }
+    }
+    pthread_mutex_unlock(&setup->lock);
+    return 0;
+}
+
+// the event queue overflowed : read again the directories whose entries changed since they were read
+void rescan_changed_directories() {
+    printf("file watcher queue overflow, rescanning changed directories\n");
+    for (int wd = 0; wd < watcher.capacity; wd++) {
+        struct watch_dir *dir = &watcher.dirs[wd];
+        struct stat st;
+        if (dir->path == NULL || stat(dir->path, &st) < 0) {
+            continue;
+        }
+        if (st.st_mtim.tv_sec != dir->mtime.tv_sec || st.st_mtim.tv_nsec != dir->mtime.tv_nsec) {
+            dir->mtime = st.st_mtim;
+            char *path = strdup(dir->path);
+            if (path != NULL) {
+                rescan_directory(path, 1);
+                free(path);
+            }
+        }
+    }
+}
+
+void handle_watch_event(struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        rescan_changed_directories();
+        return;
+    }
+    if (event->wd < 0 || event->wd >= watcher.capacity || watcher.dirs[event->wd].path == NULL) {
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        // watch removed by the kernel (directory deleted)
+        free(watcher.dirs[event->wd].path);
+        watcher.dirs[event->wd].path = NULL;
+        return;
+    }
+    if (event->len == 0) {
+        return;
+    }
+
+    char path[MAX_PATH_LENGTH];
+    if (snprintf(path, sizeof(path), "%s/%s", watcher.dirs[event->wd].path, event->name) >= (int) sizeof(path)) {
+        return;
+    }
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            add_directory(path);
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            pthread_rwlock_wrlock(&file_index.lock);
+            index_remove_subtree(path);
+            index_write_unlock();
+            unwatch_subtree(path);
+        }
+        return;
+    }
+
+    struct stat st;
+    int exists = lstat(path, &st) == 0;
+    pthread_rwlock_wrlock(&file_index.lock);
+    index_update_path(path, exists ? &st : NULL);
+    index_write_unlock();
+}
+
+int save_watched_snapshot();
+void refresh_file_metadata();
+int index_unpublished();
+int publish_index_image();
+long publish_interval_ms();
+long published_ms_ago();
+int save_index_snapshot(const struct dir_list *dirs);
+
+long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// give up on inotify, the directories are polled from here on
+void stop_watching() {
+    close(watcher.fd);
+    watcher.fd = -1;
+    for (int wd = 0; wd < watcher.capacity; wd++) {
+        free(watcher.dirs[wd].path);
+    }
+    free(watcher.dirs);
+    watcher.dirs = NULL;
+    watcher.capacity = 0;
+}
+
+// keep the index current, on the writer's index thread; returns only when the tree
+// cannot be watched (no inotify, too many directories, errors)
+int watch_files() {
+    if ((watcher.fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        perror("error: inotify_init1");
+        return EXIT_FAILURE;
+    }
+
+    struct watch_setup setup = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+    if (scan_tree(get_directory(), scan_threads, SCAN_DIRS_ONLY, watchDirectory, &setup) != EXIT_SUCCESS) {
+        // directories without a watch would go unnoticed, poll instead
+        fprintf(stderr, "error: failed to watch %s\n", get_directory());
+        watcher.failed = 1;
+    }
+    // changed between the startup walk and now : read again
+    for (int i = 0; i < setup.count; i++) {
+        if (setup.changed[i] != NULL) {
+            rescan_directory(setup.changed[i], 1);
+            free(setup.changed[i]);
+        }
+    }
+    free(setup.changed);
+    if (watcher.failed) {
+        stop_watching();
+        return EXIT_FAILURE;
+    }
+    if (file_index.from_snapshot) {
+        refresh_file_metadata();
+    }
+
+    // changes are published once the events pause for PUBLISH_DELAY_MS, and at least
+    // every publish_interval_ms() while they keep coming, never more often than that;
+    // the snapshot is saved every SNAPSHOT_INTERVAL
+    struct timespec first_change = {0, 0};
+    time_t next_snapshot = time(NULL) + SNAPSHOT_INTERVAL;
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        long interval = publish_interval_ms();
+        long timeout = -1;
+        if (index_unpublished()) {
+            long wait = interval - published_ms_ago();
+            timeout = wait > PUBLISH_DELAY_MS ? wait : PUBLISH_DELAY_MS;
+        }
+        if (snapshot_path[0] != '\0') {
+            long until = next_snapshot > time(NULL) ? (next_snapshot - time(NULL)) * 1000 : 0;
+            if (timeout < 0 || until < timeout) {
+                timeout = until;
+            }
+        }
+
+        struct pollfd poll_fd = {watcher.fd, POLLIN, 0};
+        int ready = poll(&poll_fd, 1, timeout);
+        ssize_t n = ready <= 0 ? 0 : read(watcher.fd, buffer, sizeof(buffer));
+        if ((ready < 0 || n < 0) && errno != EINTR) {
+            perror("error: reading file events");
+            stop_watching();
+            return EXIT_FAILURE;
+        }
+        for (char *p = buffer; p < buffer + n;) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            handle_watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (watcher.failed) {
+            stop_watching();
+            return EXIT_FAILURE;
+        }
+
+        if (index_unpublished()) {
+            if (first_change.tv_sec == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &first_change);
+            }
+            if ((ready == 0 && published_ms_ago() >= interval) || elapsed_ms(&first_change) >= interval) {
+                publish_index_image();
+                first_change.tv_sec = 0;
+            }
+        }
+        if (snapshot_path[0] != '\0' && time(NULL) >= next_snapshot) {
+            save_watched_snapshot();
+            next_snapshot = time(NULL) + SNAPSHOT_INTERVAL;
+        }
+    }
+}
+
+// the directory moved on since it was last read : entries added, removed or renamed
+// change the mtime, a rename of the directory itself and permission changes the ctime
+int dir_changed(const struct dir_record *dir, const struct stat *sb) {
+    return dir->mtime.tv_sec != sb->st_mtim.tv_sec || dir->mtime.tv_nsec != sb->st_mtim.tv_nsec ||
+           dir->ctime.tv_sec != sb->st_ctim.tv_sec || dir->ctime.tv_nsec != sb->st_ctim.tv_nsec;
+}
+
+// 1 when a directory above path (up to the export directory) is gone
+int parent_gone(const struct dir_list *dirs, const char *path) {
+    size_t root_length = strlen(get_directory());
+    for (size_t length = strlen(path); length > root_length; length--) {
+        if (path[length] == '/') {
+            int d = dir_list_find(dirs, path, length);
+            if (d >= 0 && dirs->dirs[d].changed == DIR_GONE) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// one polling round : stat the known directories, read again those that changed and walk
+// the subdirectories that are new; unchanged directories are not listed, their files and
+// subdirectories are the ones already known. Returns the number of directories read
+int poll_directories(struct dir_list *dirs) {
+    int gone = 0;
+    for (int i = 0; i < dirs->count; i++) {
+        struct dir_record *dir = &dirs->dirs[i];
+        struct stat st;
+        dir->changed = 0;
+        if (lstat(dir->path, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_ino != dir->ino) {
+            // removed, or replaced by another directory that is found as a new one
+            dir->changed = DIR_GONE;
+            gone++;
+        } else if (dir_changed(dir, &st)) {
+            dir->mtime = st.st_mtim;
+            dir->ctime = st.st_ctim;
+            dir->changed = 1;
+        }
+    }
+
+    // drop the files below the topmost directories that are gone, and the directories below them
+    if (gone > 0) {
+        pthread_rwlock_wrlock(&file_index.lock);
+        for (int i = 0; i < dirs->count; i++) {
+            if (parent_gone(dirs, dirs->dirs[i].path)) {
+                dirs->dirs[i].changed = DIR_GONE;
+            } else if (dirs->dirs[i].changed == DIR_GONE) {
+                index_remove_subtree(dirs->dirs[i].path);
+            }
+        }
+        index_write_unlock();
+    }
+    int kept = 0;
+    for (int i = 0; i < dirs->count; i++) {
+        if (dirs->dirs[i].changed == DIR_GONE) {
+            free(dirs->dirs[i].path);
+        } else {
+            dirs->dirs[kept++] = dirs->dirs[i];
+        }
+    }
+    dirs->count = kept;
+    if (dir_list_index(dirs) == EXIT_FAILURE) {
+        return -1;
+    }
+
+    int read = 0;
+    char child[MAX_PATH_LENGTH];
+    for (int i = 0; i < kept; i++) {
+        if (!dirs->dirs[i].changed) {
+            continue;
+        }
+        rescan_directory(dirs->dirs[i].path, 1);
+        read++;
+
+        // subdirectories that were not there before, with everything below them
+        DIR *dir = opendir(dirs->dirs[i].path);
+        struct dirent *d;
+        while (dir != NULL && (d = readdir(dir)) != NULL) {
+            struct stat st;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 || (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) ||
+                snprintf(child, sizeof(child), "%s/%s", dirs->dirs[i].path, d->d_name) >= (int) sizeof(child) ||
+                dir_list_find(dirs, child, strlen(child)) >= 0 || lstat(child, &st) < 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+            int first = dirs->count;
+            if (scan_tree(child, scan_threads, SCAN_DIRS_ONLY, recordDirectory, dirs) == EXIT_FAILURE) {
+                // still unknown, the parent is read again by the next poll
+                while (dirs->count > first) {
+                    free(dirs->dirs[--dirs->count].path);
+                }
+                dirs->dirs[i].mtime.tv_sec = 0;
+                dirs->dirs[i].mtime.tv_nsec = 0;
+                continue;
+            }
+            for (int j = first; j < dirs->count; j++) {
+                rescan_directory(dirs->dirs[j].path, 0);
+                read++;
+            }
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
+    }
+    if (dirs->count > kept && dir_list_index(dirs) == EXIT_FAILURE) {
+        return -1;
+    }
+    return read;
+}
+
+// keep the index current without inotify (not available, or missing changes made on other
+// hosts of a network file system) : poll the directories in dirs, as read when the index was built
+void poll_files(struct dir_list *dirs, int interval) {
+    printf("polling %s every %d s for directory changes\n", get_directory(), interval);
+    fflush(stdout);
+    if (dir_list_index(dirs) == EXIT_FAILURE) {
+        fprintf(stderr, "error: polling %s : %s\n", get_directory(), strerror(errno));
+        return;
+    }
+    if (file_index.from_snapshot) {
+        refresh_file_metadata();
+    }
+
+    unsigned long saved_changes = file_index.changes;
+    time_t next_snapshot = time(NULL) + SNAPSHOT_INTERVAL;
+    while (1) {
+        if (poll_directories(dirs) < 0) {
+            fprintf(stderr, "error: polling %s : %s\n", get_directory(), strerror(errno));
+            return;
+        }
+        if (index_unpublished() && published_ms_ago() >= publish_interval_ms()) {
+            publish_index_image();
+        }
+        if (snapshot_path[0] != '\0' && time(NULL) >= next_snapshot && file_index.changes != saved_changes) {
+            // the directories were all read at their recorded mtimes
+            saved_changes = file_index.changes;
+            save_index_snapshot(dirs);
+            next_snapshot = time(NULL) + SNAPSHOT_INTERVAL;
+        }
+        sleep(interval);
+    }
+}
+
+//////////////////////////// FILE WATCHER END ///////////////////////////////////////
+
+//////////////////////////// INDEX SNAPSHOT START ///////////////////////////////////////
+
+// the file index saved to disk, so a restart does not have to walk the whole tree.
+// Everything is referenced by offsets from the start of the file; it is mmap'ed read only
+// and checked (version, bounds, checksum, export directory) before it is used, then
+// only the directories whose mtime moved since it was written are read again
+struct snapshot_header {
+    char magic[4]; // "W24I"
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t file_count;
+    uint32_t dir_count;
+    uint32_t reserved;
+    uint64_t files; // offset of struct snapshot_file[file_count]
+    uint64_t dirs; // offset of struct snapshot_dir[dir_count]
+    uint64_t strings; // offset of the '\0' terminated paths
+    uint64_t strings_size;
+    uint64_t root; // the export directory, offset into the strings
+    uint64_t checksum; // of everything after the header
+};
+
+struct snapshot_file {
+    uint64_t path; // offset into the strings
+    uint32_t name_offset;
+    uint32_t mode;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    int64_t btime;
+};
+
+struct snapshot_dir {
+    uint64_t path;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+uint64_t snapshot_checksum(const unsigned char *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325UL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3UL;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3UL;
+    }
+    return hash;
+}
+
+// write the index and the directory mtimes to a temporary file and rename it over the snapshot
+int save_index_snapshot(const struct dir_list *dirs) {
+    if (snapshot_path[0] == '\0') {
+        return EXIT_SUCCESS;
+    }
+    char temp[MAX_PATH_LENGTH + 16];
+    snprintf(temp, sizeof(temp), "%s.%d", snapshot_path, getpid());
+    FILE *file = fopen(temp, "w+");
+    if (file == NULL) {
+        fprintf(stderr, "error: saving index snapshot %s : %s\n", temp, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    pthread_rwlock_rdlock(&file_index.lock);
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "W24I", 4);
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(header);
+    header.file_count = file_index.live;
+    header.dir_count = dirs->count;
+    header.files = sizeof(header);
+    header.dirs = header.files + (uint64_t) header.file_count * sizeof(struct snapshot_file);
+    header.strings = header.dirs + (uint64_t) header.dir_count * sizeof(struct snapshot_dir);
+    header.root = 0;
+    fwrite(&header, sizeof(header), 1, file);
+
+    // the strings are written after the records, in the same order
+    uint64_t offset = strlen(get_directory()) + 1;
+    for (int i = 0; i < file_index.count; i++) {
+        struct index_entry *e = &file_index.entries[i];
+        if (e->path != NULL) {
+            struct snapshot_file record = {offset, e->name - e->path, e->mode, e->size, e->mtime, e->ctime, e->btime};
+            fwrite(&record, sizeof(record), 1, file);
+            offset += strlen(e->path) + 1;
+        }
+    }
+    for (int i = 0; i < dirs->count; i++) {
+        struct snapshot_dir record = {offset, dirs->dirs[i].mtime.tv_sec, dirs->dirs[i].mtime.tv_nsec};
+        fwrite(&record, sizeof(record), 1, file);
+        offset += strlen(dirs->dirs[i].path) + 1;
+    }
+    header.strings_size = offset;
+
+    fwrite(get_directory(), strlen(get_directory()) + 1, 1, file);
+    for (int i = 0; i < file_index.count; i++) {
+        if (file_index.entries[i].path != NULL) {
+            fwrite(file_index.entries[i].path, strlen(file_index.entries[i].path) + 1, 1, file);
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    for (int i = 0; i < dirs->count; i++) {
+        fwrite(dirs->dirs[i].path, strlen(dirs->dirs[i].path) + 1, 1, file);
+    }
+
+    int status = EXIT_FAILURE;
+    long size = ftell(file);
+    if (fflush(file) == 0 && !ferror(file) && size == (long) (header.strings + header.strings_size)) {
+        unsigned char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            header.checksum = snapshot_checksum(map + sizeof(header), size - sizeof(header));
+            munmap(map, size);
+            if (pwrite(fileno(file), &header, sizeof(header), 0) == sizeof(header) && fsync(fileno(file)) == 0) {
+                status = EXIT_SUCCESS;
+            }
+        }
+    }
+    if (fclose(file) != 0 || status == EXIT_FAILURE || rename(temp, snapshot_path) < 0) {
+        fprintf(stderr, "error: saving index snapshot %s : %s\n", snapshot_path, strerror(errno));
+        unlink(temp);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// called on the writer's index thread, its watch table has every directory
+int save_watched_snapshot() {
+    static unsigned long saved_changes = 0;
+    pthread_rwlock_rdlock(&file_index.lock);
+    unsigned long changes = file_index.changes;
+    pthread_rwlock_unlock(&file_index.lock);
+    if (changes == saved_changes) {
+        return EXIT_SUCCESS;
+    }
+
+    // a watched directory keeps the mtime from when its entries were read, newer
+    // changes came in as events; a directory that moved on is read again at the next start
+    struct dir_list dirs = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0};
+    int status = EXIT_SUCCESS;
+    struct stat sb;
+    memset(&sb, 0, sizeof(sb));
+    for (int wd = 0; wd < watcher.capacity && status == EXIT_SUCCESS; wd++) {
+        if (watcher.dirs[wd].path != NULL) {
+            sb.st_mtim = watcher.dirs[wd].mtime;
+            status = dir_list_add(&dirs, watcher.dirs[wd].path, &sb);
+        }
+    }
+    if (status == EXIT_SUCCESS && save_index_snapshot(&dirs) == EXIT_SUCCESS) {
+        saved_changes = changes;
+    }
+    dir_list_free(&dirs);
+    return status;
+}
+
+// the string at offset in the snapshot, NULL when it is out of bounds
+const char *snapshot_string(const struct snapshot_header *header, const char *strings, uint64_t offset) {
+    return offset < header->strings_size ? strings + offset : NULL;
+}
+
+// load the index from the snapshot and bring it up to date; the directories of the
+// tree are left in dirs. EXIT_FAILURE : no usable snapshot, the tree has to be walked
+int load_file_index(struct dir_list *dirs) {
+    if (snapshot_path[0] == '\0') {
+        return EXIT_FAILURE;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct snapshot_header)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return EXIT_FAILURE;
+    }
+
+    const struct snapshot_header *header = (const struct snapshot_header *) map;
+    const struct snapshot_file *files = (const struct snapshot_file *) (map + header->files);
+    const struct snapshot_dir *snapshot_dirs = (const struct snapshot_dir *) (map + header->dirs);
+    const char *strings = (const char *) map + header->strings;
+    uint64_t size = st.st_size;
+    if (memcmp(header->magic, "W24I", 4) != 0 || header->version != SNAPSHOT_VERSION || header->header_size != sizeof(struct snapshot_header) ||
+        header->files != sizeof(struct snapshot_header) ||
+        header->dirs != header->files + (uint64_t) header->file_count * sizeof(struct snapshot_file) ||
+        header->strings != header->dirs + (uint64_t) header->dir_count * sizeof(struct snapshot_dir) ||
+        header->strings > size || header->strings_size != size - header->strings || header->strings_size == 0 || strings[header->strings_size - 1] != '\0' ||
+        header->checksum != snapshot_checksum(map + sizeof(struct snapshot_header), size - sizeof(struct snapshot_header)) ||
+        snapshot_string(header, strings, header->root) == NULL || strcmp(strings + header->root, get_directory()) != 0) {
+        fprintf(stderr, "error: index snapshot %s is not usable, indexing from scratch\n", snapshot_path);
+        munmap(map, size);
+        return EXIT_FAILURE;
+    }
+
+    // the directories as they are now, against their mtimes in the snapshot
+    struct dir_list previous = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0};
+    int status = EXIT_SUCCESS;
+    struct stat sb;
+    memset(&sb, 0, sizeof(sb));
+    for (uint32_t i = 0; i < header->dir_count && status == EXIT_SUCCESS; i++) {
+        const char *path = snapshot_string(header, strings, snapshot_dirs[i].path);
+        sb.st_mtim.tv_sec = snapshot_dirs[i].mtime_sec;
+        sb.st_mtim.tv_nsec = snapshot_dirs[i].mtime_nsec;
+        status = path == NULL ? EXIT_FAILURE : dir_list_add(&previous, path, &sb);
+    }
+    clock_gettime(CLOCK_REALTIME, &file_index.built_at);
+    if (status == EXIT_FAILURE || dir_list_index(&previous) == EXIT_FAILURE ||
+        scan_tree(get_directory(), scan_threads, SCAN_DIRS_ONLY, recordDirectory, dirs) == EXIT_FAILURE) {
+        dir_list_free(&previous);
+        dir_list_free(dirs);
+        munmap(map, size);
+        return EXIT_FAILURE;
+    }
+
+    int changed = 0;
+    for (int i = 0; i < dirs->count; i++) {
+        struct dir_record *dir = &dirs->dirs[i];
+        int j = dir_list_find(&previous, dir->path, strlen(dir->path));
+        dir->changed = j < 0 || previous.dirs[j].mtime.tv_sec != dir->mtime.tv_sec || previous.dirs[j].mtime.tv_nsec != dir->mtime.tv_nsec;
+        changed += dir->changed;
+    }
+    dir_list_free(&previous);
+    // reading most directories one by one is slower than a fresh walk
+    if (changed > dirs->count / 4 + 16) {
+        printf("index snapshot: %d of %d directories changed, indexing from scratch\n", changed, dirs->count);
+        dir_list_free(dirs);
+        munmap(map, size);
+        return EXIT_FAILURE;
+    }
+
+    pthread_rwlock_wrlock(&file_index.lock);
+    for (uint32_t i = 0; i < header->file_count && status == EXIT_SUCCESS; i++) {
+        const struct snapshot_file *record = &files[i];
+        const char *path = snapshot_string(header, strings, record->path);
+        if (path == NULL || record->name_offset > strlen(path)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        struct stat sb;
+        memset(&sb, 0, sizeof(sb));
+        sb.st_mode = record->mode;
+        sb.st_size = record->size;
+        sb.st_mtime = record->mtime;
+        sb.st_ctime = record->ctime;
+        status = index_add(path, record->name_offset, &sb, record->btime);
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    munmap(map, size);
+    if (status == EXIT_FAILURE || dir_list_index(dirs) == EXIT_FAILURE) {
+        // leave a clean index for the walk
+        pthread_rwlock_wrlock(&file_index.lock);
+        for (int i = 0; i < file_index.count; i++) {
+            free(file_index.entries[i].path);
+        }
+        file_index.count = file_index.live = 0;
+        index_rehash(file_index.bucket_count);
+        pthread_rwlock_unlock(&file_index.lock);
+        dir_list_free(dirs);
+        return EXIT_FAILURE;
+    }
+    file_index.changes = 0;
+
+    // read the changed directories again, then drop the files that are gone from them
+    // and those of directories that do not exist anymore
+    unsigned int first_scan = watcher.scan + 1;
+    for (int i = 0; i < dirs->count; i++) {
+        if (dirs->dirs[i].changed) {
+            rescan_directory(dirs->dirs[i].path, 0);
+        }
+    }
+    pthread_rwlock_wrlock(&file_index.lock);
+    for (int i = 0; i < file_index.count; i++) {
+        struct index_entry *e = &file_index.entries[i];
+        if (e->path == NULL) {
+            continue;
+        }
+        int d = dir_list_find(dirs, e->path, e->name - e->path - 1);
+        if (d < 0 || (dirs->dirs[d].changed && e->seen < first_scan)) {
+            index_remove(i);
+        }
+    }
+    if (file_index.live < file_index.count) {
+        index_compact();
+    } else {
+        index_build_secondary();
+    }
+    file_index.ready = 1;
+    file_index.from_snapshot = 1;
+    unsigned long changes = file_index.changes;
+    pthread_rwlock_unlock(&file_index.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("loaded %d files from %s in %.1f ms, %d of %d directories read again\n", file_index.live, snapshot_path,
+           (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0, changed, dirs->count);
+    if (changed > 0 || changes > 0) {
+        save_index_snapshot(dirs);
+    }
+    return EXIT_SUCCESS;
+}
+
+// files rewritten in place while the server was down leave the directory mtime alone;
+// stat every file once, in the background, after a snapshot was loaded
+void refresh_file_metadata() {
+    char path[MAX_PATH_LENGTH];
+    for (int i = 0;; i++) {
+        pthread_rwlock_rdlock(&file_index.lock);
+        if (i >= file_index.count) {
+            pthread_rwlock_unlock(&file_index.lock);
+            break;
+        }
+        struct index_entry e = file_index.entries[i];
+        if (e.path != NULL) {
+            snprintf(path, sizeof(path), "%s", e.path);
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+        if (e.path == NULL) {
+            continue;
+        }
+
+        struct stat st;
+        int exists = lstat(path, &st) == 0;
+        if (!exists || st.st_size != e.size || st.st_mtime != e.mtime || st.st_ctime != e.ctime) {
+            // not compacted before the walk is done, i would skip entries
+            pthread_rwlock_wrlock(&file_index.lock);
+            index_update_path(path, exists ? &st : NULL);
+            pthread_rwlock_unlock(&file_index.lock);
+        }
+    }
+    pthread_rwlock_wrlock(&file_index.lock);
+    index_write_unlock();
+}
+
+//////////////////////////// INDEX SNAPSHOT END ///////////////////////////////////////
+
+//////////////////////////// SHARED INDEX START ///////////////////////////////////////
+
+// one copy of the index for every server process on the host exporting the same directory
+// (the workers of serverw24, mirror1 and mirror2). The process holding the lock on the
+// control segment keeps the index and the watcher, and publishes the index as an immutable
+// image in shared memory, a new generation after each batch of changes. Readers map the
+// generation named in the control segment and never wait for the writer; a replaced image
+// is only unlinked, it stays valid for as long as a reader has it mapped
+struct image_header {
+    char magic[4]; // "W24S"
+    uint32_t version;
+    uint64_t generation;
+    uint64_t size;
+    uint32_t file_count;
+    uint32_t ext_count;
+    uint32_t trigram_count;
+    uint32_t reserved;
+    uint64_t files; // struct snapshot_file[file_count], in index order
+    uint64_t ordered[ORDERED_KEYS]; // entry numbers (int) in key order, ties in index order
+    uint64_t ordered_count[ORDERED_KEYS];
+    uint64_t exts; // struct image_ext[ext_count], sorted by extension
+    uint64_t trigrams; // struct image_trigram[trigram_count], sorted by trigram
+    uint64_t postings; // entry numbers (int) of the extension and trigram lists, ascending per list
+    uint64_t posting_count;
+    uint64_t strings;
+    uint64_t strings_size;
+    uint64_t root; // offset of the export directory in the strings
+};
+
+struct image_ext {
+    char ext[MAX_EXTENSION_LENGTH + 1];
+    uint64_t first; // position in the postings
+    uint32_t count;
+    uint32_t reserved;
+    int64_t bytes;
+};
+
+struct image_trigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t first;
+};
+
+struct shared_control {
+    char magic[4]; // "W24C"
+    uint64_t generation; // image being served, 0 : none yet
+    int32_t writer; // pid of the writer
+};
+
+// an image mapped by this process, unmapped when the last query using it is done
+struct image_map {
+    unsigned char *base;
+    size_t size;
+    uint64_t generation;
+    int refs;
+};
+
+struct shared_index {
+    pthread_mutex_t lock; // the current map and its reference counts, process local
+    struct shared_control *control;
+    int control_fd; // flock()'ed by the writer
+    int live_fd; // "<name>_live", LOCK_SH'ed by every server process using the index
+    char name[64]; // "/w24_<export directory hash>", the images add "_<generation>"
+    struct image_map *current;
+    int writer; // this process keeps the index
+    unsigned long published_changes; // file_index.changes in the current image, the writer only
+    struct timespec published_at; // monotonic, the writer only
+    uint64_t published_size; // bytes of the current image, the writer only
+};
+
+struct shared_index shared = {PTHREAD_MUTEX_INITIALIZER, NULL, -1, -1, "", NULL, 0, 0, {0, 0}, 0};
+
+void image_name(char *buffer, size_t size, uint64_t generation) {
+    snprintf(buffer, size, "%s_%llu", shared.name, (unsigned long long) generation);
+}
+
+// map the control segment, before the workers are forked so they inherit it
+int shared_index_open() {
+    snprintf(shared.name, sizeof(shared.name), "/w24_%016lx", path_hash(get_directory()));
+
+    // the lock lives as long as the process and its workers, a crash releases it too;
+    // a segment unlinked meanwhile by the last server leaving is opened again
+    char live[96];
+    snprintf(live, sizeof(live), "%s_live", shared.name);
+    while (1) {
+        struct stat st;
+        shared.live_fd = shm_open(live, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+        if (shared.live_fd < 0 || flock(shared.live_fd, LOCK_SH) < 0 || fstat(shared.live_fd, &st) < 0) {
+            fprintf(stderr, "error: shared memory %s : %s\n", live, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (st.st_nlink > 0) {
+            break;
+        }
+        close(shared.live_fd);
+    }
+
+    shared.control_fd = shm_open(shared.name, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+    if (shared.control_fd < 0 || ftruncate(shared.control_fd, sizeof(struct shared_control)) < 0) {
+        fprintf(stderr, "error: shared memory %s : %s\n", shared.name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    shared.control = mmap(NULL, sizeof(struct shared_control), PROT_READ | PROT_WRITE, MAP_SHARED, shared.control_fd, 0);
+    if (shared.control == MAP_FAILED) {
+        perror("error: mmap shared index");
+        return EXIT_FAILURE;
+    }
+    memcpy(shared.control->magic, "W24C", 4);
+    return EXIT_SUCCESS;
+}
+
+// the last server process on the host removes the shared memory : no other process,
+// live or crashed with its workers gone, holds the liveness lock then
+void shared_index_close() {
+    if (shared.control == NULL || flock(shared.live_fd, LOCK_EX | LOCK_NB) < 0) {
+        return;
+    }
+    char name[96];
+    image_name(name, sizeof(name), __atomic_load_n(&shared.control->generation, __ATOMIC_ACQUIRE));
+    shm_unlink(name);
+    shm_unlink(shared.name);
+    snprintf(name, sizeof(name), "%s_live", shared.name);
+    shm_unlink(name);
+}
+
+int compare_ext_postings(const void *a, const void *b) {
+    return strcmp((*(struct ext_posting **) a)->ext, (*(struct ext_posting **) b)->ext);
+}
+
+int compare_trigram_postings(const void *a, const void *b) {
+    return compare_trigrams(&(*(struct trigram_posting **) a)->trigram, &(*(struct trigram_posting **) b)->trigram);
+}
+
+// minimum time between two images, they cost O(index size) to copy
+long publish_interval_ms() {
+    long interval = shared.published_size * 1000 / PUBLISH_BYTES_PER_SECOND;
+    return interval > PUBLISH_MAX_DELAY_MS ? interval : PUBLISH_MAX_DELAY_MS;
+}
+
+long published_ms_ago() {
+    return elapsed_ms(&shared.published_at);
+}
+
+// the index changed since it was last published
+int index_unpublished() {
+    pthread_rwlock_rdlock(&file_index.lock);
+    int unpublished = file_index.changes != shared.published_changes;
+    pthread_rwlock_unlock(&file_index.lock);
+    return unpublished;
+}
+
+struct image_copy {
+    int *sorted;
+    long count;
+    const int *renumber;
+};
+
+int copyOrderedItem(const struct ordered_item *item, void *arg) {
+    struct image_copy *copy = arg;
+    copy->sorted[copy->count++] = copy->renumber[item->entry];
+    return 0;
+}
+
+// copy the index into a new image and make it the current generation, the writer only
+int publish_index_image() {
+    pthread_rwlock_rdlock(&file_index.lock);
+    if (!file_index.secondary) {
+        pthread_rwlock_unlock(&file_index.lock);
+        return EXIT_FAILURE;
+    }
+
+    // entry numbers without the removed entries
+    int *renumber = malloc((file_index.count + 1) * sizeof(int));
+    struct ext_posting **exts = malloc((file_index.by_ext.extensions + 1) * sizeof(struct ext_posting *));
+    struct trigram_posting **trigrams = malloc((file_index.by_trigram.trigrams + 1) * sizeof(struct trigram_posting *));
+    if (renumber == NULL || exts == NULL || trigrams == NULL) {
+        pthread_rwlock_unlock(&file_index.lock);
+        free(renumber);
+        free(exts);
+        free(trigrams);
+        return EXIT_FAILURE;
+    }
+
+    unsigned long changes = file_index.changes;
+    uint64_t strings_size = strlen(get_directory()) + 1;
+    int live = 0;
+    for (int i = 0; i < file_index.count; i++) {
+        renumber[i] = -1;
+        if (file_index.entries[i].path != NULL) {
+            renumber[i] = live++;
+            strings_size += strlen(file_index.entries[i].path) + 1;
+        }
+    }
+    int ext_count = 0;
+    uint64_t posting_count = 0;
+    for (int b = 0; b < EXT_BUCKETS; b++) {
+        for (struct ext_posting *posting = file_index.by_ext.buckets[b]; posting != NULL; posting = posting->next) {
+            if (posting->count > 0) {
+                exts[ext_count++] = posting;
+                posting_count += posting->count;
+            }
+        }
+    }
+    int trigram_count = 0;
+    for (int b = 0; b < TRIGRAM_BUCKETS; b++) {
+        for (struct trigram_posting *posting = file_index.by_trigram.buckets[b]; posting != NULL; posting = posting->next) {
+            if (posting->count > 0) {
+                trigrams[trigram_count++] = posting;
+                posting_count += posting->count;
+            }
+        }
+    }
+    qsort(exts, ext_count, sizeof(exts[0]), compare_ext_postings);
+    qsort(trigrams, trigram_count, sizeof(trigrams[0]), compare_trigram_postings);
+
+    struct image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "W24S", 4);
+    header.version = SNAPSHOT_VERSION;
+    header.generation = __atomic_load_n(&shared.control->generation, __ATOMIC_ACQUIRE) + 1;
+    header.file_count = live;
+    header.ext_count = ext_count;
+    header.trigram_count = trigram_count;
+    header.posting_count = posting_count;
+    uint64_t offset = sizeof(header);
+    header.files = offset;
+    offset += (uint64_t) live * sizeof(struct snapshot_file);
+    for (int key = 0; key < ORDERED_KEYS; key++) {
+        header.ordered[key] = offset;
+        header.ordered_count[key] = file_index.ordered[key].size;
+        offset += (file_index.ordered[key].size * sizeof(int) + 7) & ~7UL;
+    }
+    header.exts = offset;
+    offset += (uint64_t) ext_count * sizeof(struct image_ext);
+    header.trigrams = offset;
+    offset += (uint64_t) trigram_count * sizeof(struct image_trigram);
+    header.postings = offset;
+    offset += (posting_count * sizeof(int) + 7) & ~7UL;
+    header.strings = offset;
+    header.strings_size = strings_size;
+    header.size = offset + strings_size;
+
+    char name[96];
+    image_name(name, sizeof(name), header.generation);
+    // a left over from a writer that died while publishing
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    unsigned char *base = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, header.size) == 0) {
+        base = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        pthread_rwlock_unlock(&file_index.lock);
+        fprintf(stderr, "error: publishing index image %s : %s\n", name, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name);
+        }
+        free(renumber);
+        free(exts);
+        free(trigrams);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    char *strings = (char *) base + header.strings;
+    uint64_t string = strlen(get_directory()) + 1;
+    memcpy(strings, get_directory(), string);
+    struct snapshot_file *files = (struct snapshot_file *) (base + header.files);
+    for (int i = 0; i < file_index.count; i++) {
+        struct index_entry *e = &file_index.entries[i];
+        if (e->path != NULL) {
+            struct snapshot_file record = {string, e->name - e->path, e->mode, e->size, e->mtime, e->ctime, e->btime};
+            files[renumber[i]] = record;
+            size_t length = strlen(e->path) + 1;
+            memcpy(strings + string, e->path, length);
+            string += length;
+        }
+    }
+    // the secondary indexes are in order already, this is a copy
+    for (int key = 0; key < ORDERED_KEYS; key++) {
+        struct image_copy copy = {(int *) (base + header.ordered[key]), 0, renumber};
+        ordered_range(&file_index.ordered[key], INT64_MIN, INT64_MAX, copyOrderedItem, &copy);
+    }
+    int *postings = (int *) (base + header.postings);
+    uint64_t position = 0;
+    struct image_ext *image_exts = (struct image_ext *) (base + header.exts);
+    for (int i = 0; i < ext_count; i++) {
+        memcpy(image_exts[i].ext, exts[i]->ext, sizeof(image_exts[i].ext));
+        image_exts[i].first = position;
+        image_exts[i].count = exts[i]->count;
+        image_exts[i].bytes = exts[i]->bytes;
+        for (int j = 0; j < exts[i]->count; j++) {
+            postings[position++] = renumber[exts[i]->entries[j]];
+        }
+    }
+    struct image_trigram *image_trigrams = (struct image_trigram *) (base + header.trigrams);
+    for (int i = 0; i < trigram_count; i++) {
+        image_trigrams[i].trigram = trigrams[i]->trigram;
+        image_trigrams[i].first = position;
+        image_trigrams[i].count = trigrams[i]->count;
+        for (int j = 0; j < trigrams[i]->count; j++) {
+            postings[position++] = renumber[trigrams[i]->entries[j]];
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    free(renumber);
+    free(exts);
+    free(trigrams);
+
+    memcpy(base, &header, sizeof(header));
+    munmap(base, header.size);
+
+    // readers that still look for the old generation find it gone and read the number again
+    uint64_t previous = __atomic_exchange_n(&shared.control->generation, header.generation, __ATOMIC_ACQ_REL);
+    if (previous != 0) {
+        image_name(name, sizeof(name), previous);
+        shm_unlink(name);
+    }
+    shared.published_changes = changes;
+    shared.published_size = header.size;
+    clock_gettime(CLOCK_MONOTONIC, &shared.published_at);
+    return EXIT_SUCCESS;
+}
+
+struct image_map *image_open(uint64_t generation) {
+    char name[96];
+    image_name(name, sizeof(name), generation);
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    struct image_map *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct image_header) && (map = calloc(1, sizeof(struct image_map))) != NULL) {
+        map->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        map->size = st.st_size;
+        map->generation = generation;
+        const struct image_header *header = (const struct image_header *) map->base;
+        if (map->base == MAP_FAILED || memcmp(header->magic, "W24S", 4) != 0 || header->version != SNAPSHOT_VERSION ||
+            header->generation != generation || header->size != map->size) {
+            if (map->base != MAP_FAILED) {
+                munmap(map->base, map->size);
+            }
+            free(map);
+            map = NULL;
+        }
+    }
+    close(fd);
+    return map;
+}
+
+void image_release(struct image_map *map) {
+    pthread_mutex_lock(&shared.lock);
+    if (--map->refs == 0) {
+        munmap(map->base, map->size);
+        free(map);
+    }
+    pthread_mutex_unlock(&shared.lock);
+}
+
+// the current image, held until image_release(); NULL until the first one is published
+struct image_map *image_acquire() {
+    pthread_mutex_lock(&shared.lock);
+    for (int attempt = 0; attempt < 8; attempt++) {
+        uint64_t generation = __atomic_load_n(&shared.control->generation, __ATOMIC_ACQUIRE);
+        if (generation == 0 || (shared.current != NULL && shared.current->generation == generation)) {
+            break;
+        }
+        struct image_map *map = image_open(generation);
+        if (map != NULL) {
+            if (shared.current != NULL && --shared.current->refs == 0) {
+                munmap(shared.current->base, shared.current->size);
+                free(shared.current);
+            }
+            map->refs = 1; // held as the current image
+            shared.current = map;
+            break;
+        }
+        // replaced in the meantime
+    }
+
+    struct image_map *map = shared.current;
+    if (map != NULL) {
+        map->refs++;
+    }
+    pthread_mutex_unlock(&shared.lock);
+    return map;
+}
+
+const struct image_header *image_header(const struct image_map *map) {
+    return (const struct image_header *) map->base;
+}
+
+const struct snapshot_file *image_file(const struct image_map *map, int entry) {
+    return (const struct snapshot_file *) (map->base + image_header(map)->files) + entry;
+}
+
+const char *image_path(const struct image_map *map, int entry) {
+    return (const char *) map->base + image_header(map)->strings + image_file(map, entry)->path;
+}
+
+int64_t image_key(const struct image_map *map, int entry, int key) {
+    const struct snapshot_file *file = image_file(map, entry);
+    return key == KEY_SIZE ? file->size : key == KEY_MTIME ? file->mtime : key == KEY_CTIME ? file->ctime : file->btime;
+}
+
+// first position in the key order with a key >= key
+long image_lower_bound(const struct image_map *map, int key, int64_t value) {
+    const int *sorted = (const int *) (map->base + image_header(map)->ordered[key]);
+    long low = 0;
+    long high = image_header(map)->ordered_count[key];
+    while (low < high) {
+        long middle = low + (high - low) / 2;
+        if (image_key(map, sorted[middle], key) < value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// the job's result : entry numbers in the image it holds, no copies of the paths.
+// Sources that produce entries in index order stop once the limit is reached,
+// the others keep at most twice the limit before they are cut down to the lowest entries
+int result_add(struct archive_job *job, int entry) {
+    if (job->file_count == job->entry_capacity) {
+        int capacity = job->entry_capacity == 0 ? 256 : job->entry_capacity * 2;
+        int *entries = realloc(job->entries, capacity * sizeof(int));
+        if (entries == NULL) {
+            return EXIT_FAILURE;
+        }
+        job->entries = entries;
+        job->entry_capacity = capacity;
+    }
+    job->entries[job->file_count++] = entry;
+    return EXIT_SUCCESS;
+}
+
+int result_full(const struct archive_job *job) {
+    return job->limit > 0 && job->file_count >= job->limit;
+}
+
+int compare_ints(const void *a, const void *b) {
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return x < y ? -1 : x > y;
+}
+
+// index order, and no more than the limit
+void result_sort(struct archive_job *job) {
+    qsort(job->entries, job->file_count, sizeof(int), compare_ints);
+    if (result_full(job)) {
+        job->file_count = job->limit;
+    }
+}
+
+// add an entry found out of index order
+int result_select(struct archive_job *job, int entry) {
+    if (job->limit > 0 && job->file_count >= 2 * job->limit) {
+        result_sort(job);
+    }
+    return result_add(job, entry);
+}
+
+const char *result_path(const struct archive_job *job, int i) {
+    return image_path(job->image, job->entries[i]);
+}
+
+// the image the job's result refers to, released with the job
+struct image_map *result_image(struct archive_job *job) {
+    if (job->image == NULL && (job->image = image_acquire()) == NULL) {
+        printf("error: file index not ready\n");
+    }
+    return job->image;
+}
+
+// files with low <= key <= high in index order; ORDER_NEWEST / ORDER_OLDEST return
+// the highest / lowest keys first instead
+int index_collect_range(int key, int64_t low, int64_t high, int order) {
+    struct image_map *map = result_image(current_job);
+    if (map == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    const int *sorted = (const int *) (map->base + image_header(map)->ordered[key]);
+    long first = image_lower_bound(map, key, low);
+    long end = high == INT64_MAX ? (long) image_header(map)->ordered_count[key] : image_lower_bound(map, key, high + 1);
+    int status = EXIT_SUCCESS;
+    if (order == ORDER_NEWEST) {
+        for (long i = end - 1; i >= first && !result_full(current_job) && status == EXIT_SUCCESS; i--) {
+            status = result_add(current_job, sorted[i]);
+        }
+    } else if (order == ORDER_OLDEST) {
+        for (long i = first; i < end && !result_full(current_job) && status == EXIT_SUCCESS; i++) {
+            status = result_add(current_job, sorted[i]);
+        }
+    } else {
+        for (long i = first; i < end && status == EXIT_SUCCESS; i++) {
+            status = result_select(current_job, sorted[i]);
+        }
+        result_sort(current_job);
+    }
+
+    return status == EXIT_SUCCESS && current_job->file_count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+const struct image_ext *image_find_ext(const struct image_map *map, const char *ext) {
+    const struct image_ext *exts = (const struct image_ext *) (map->base + image_header(map)->exts);
+    int low = 0;
+    int high = image_header(map)->ext_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int compare = strcmp(exts[middle].ext, ext);
+        if (compare == 0) {
+            return &exts[middle];
+        }
+        if (compare < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+// an extension as the client sends it ("pdf", ".PDF") as it is indexed; 0 when it is too long
+int fold_extension(const char *requested, char *ext) {
+    if (requested[0] == '.') {
+        requested++;
+    }
+    if (strlen(requested) > MAX_EXTENSION_LENGTH) {
+        return 0;
+    }
+    int i = 0;
+    for (const char *p = requested; *p != '\0'; p++) {
+        ext[i++] = tolower((unsigned char) *p);
+    }
+    ext[i] = '\0';
+    return 1;
+}
+
+// files with any of the extensions, the merged posting lists in index order
+int index_collect_extensions(char exts[][MAX_PATH_LENGTH], int ext_count) {
+    struct image_map *map = result_image(current_job);
+    if (map == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    const int *postings = (const int *) (map->base + image_header(map)->postings);
+    const struct image_ext *lists[MAX_FILE_TYPES];
+    uint32_t positions[MAX_FILE_TYPES];
+    int list_count = 0;
+    for (int i = 0; i < ext_count && list_count < MAX_FILE_TYPES; i++) {
+        char ext[MAX_EXTENSION_LENGTH + 1];
+        const struct image_ext *list = fold_extension(exts[i], ext) ? image_find_ext(map, ext) : NULL;
+        if (list != NULL) {
+            lists[list_count] = list;
+            positions[list_count] = 0;
+            list_count++;
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+    int last = -1;
+    while (!result_full(current_job) && status == EXIT_SUCCESS) {
+        int best = -1;
+        for (int i = 0; i < list_count; i++) {
+            if (positions[i] < lists[i]->count &&
+                (best < 0 || postings[lists[i]->first + positions[i]] < postings[lists[best]->first + positions[best]])) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        int entry = postings[lists[best]->first + positions[best]++];
+        // the same extension given twice
+        if (entry != last) {
+            status = result_add(current_job, entry);
+            last = entry;
+        }
+    }
+
+    return status == EXIT_SUCCESS && current_job->file_count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+const struct image_trigram *image_find_trigram(const struct image_map *map, unsigned int trigram) {
+    const struct image_trigram *trigrams = (const struct image_trigram *) (map->base + image_header(map)->trigrams);
+    int low = 0;
+    int high = image_header(map)->trigram_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (trigrams[middle].trigram == trigram) {
+            return &trigrams[middle];
+        }
+        if (trigrams[middle].trigram < trigram) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+int compare_image_trigrams(const void *a, const void *b) {
+    return (*(const struct image_trigram **) a)->count - (*(const struct image_trigram **) b)->count;
+}
+
+// call visit, in index order, for the entries from `from` on in the posting lists of all the trigrams of name
+// (the candidates for a path containing it) until it returns non-zero; the lists are
+// intersected starting from the shortest. Returns -1 when name has no trigrams
+int image_trigram_candidates(const struct image_map *map, const char *name, int from, int (*visit)(int entry, void *arg), void *arg) {
+    unsigned int *trigrams = NULL;
+    int count = text_trigrams(name, &trigrams);
+    const int *postings = (const int *) (map->base + image_header(map)->postings);
+    const struct image_trigram **lists = count > 0 ? malloc(count * sizeof(struct image_trigram *)) : NULL;
+    uint32_t *positions = count > 0 ? calloc(count, sizeof(uint32_t)) : NULL;
+    if (lists == NULL || positions == NULL) {
+        free(positions);
+        free(lists);
+        free(trigrams);
+        return -1;
+    }
+
+    int t = 0;
+    while (t < count && (lists[t] = image_find_trigram(map, trigrams[t])) != NULL) {
+        t++;
+    }
+    // a missing trigram : nothing can match
+    if (t == count) {
+        qsort(lists, count, sizeof(lists[0]), compare_image_trigrams);
+        int stop = 0;
+        const int *first = postings + lists[0]->first;
+        for (uint32_t c = posting_position(first, lists[0]->count, from); c < lists[0]->count && !stop; c++) {
+            int entry = first[c];
+            int in_all = 1;
+            for (int i = 1; i < count && in_all; i++) {
+                const int *list = postings + lists[i]->first;
+                positions[i] += posting_position(list + positions[i], lists[i]->count - positions[i], entry);
+                if (positions[i] == lists[i]->count) {
+                    stop = 1;
+                    in_all = 0;
+                } else {
+                    in_all = list[positions[i]] == entry;
+                }
+            }
+            if (in_all) {
+                stop = visit(entry, arg);
+            }
+        }
+    }
+    free(positions);
+    free(lists);
+    free(trigrams);
+    return 0;
+}
+
+// length of the shortest posting list of name's trigrams, an upper bound of its matches;
+// -1 when name has no trigrams
+long image_trigram_estimate(const struct image_map *map, const char *name) {
+    unsigned int *trigrams = NULL;
+    int count = text_trigrams(name, &trigrams);
+    long estimate = count > 0 ? (long) image_header(map)->file_count : -1;
+    for (int t = 0; t < count && estimate > 0; t++) {
+        const struct image_trigram *list = image_find_trigram(map, trigrams[t]);
+        if (list == NULL || list->count < estimate) {
+            estimate = list == NULL ? 0 : list->count;
+        }
+    }
+    free(trigrams);
+    return estimate;
+}
+
+struct name_search {
+    const struct image_map *map;
+    const char *name;
+    int found;
+};
+
+// the trigrams may be in a different order or apart, the path is compared
+int matchImageName(int entry, void *arg) {
+    struct name_search *search = arg;
+    if (strContains((char *) image_path(search->map, entry), (char *) search->name)) {
+        search->found = entry;
+        return 1;
+    }
+    return 0;
+}
+
+// lowest entry whose path contains name, from the trigram index unless name is too short
+int image_find_name(const struct image_map *map, const char *name) {
+    struct name_search search = {map, name, -1};
+    if (image_trigram_candidates(map, name + root_skip(name), 0, matchImageName, &search) == 0) {
+        return search.found;
+    }
+    for (uint32_t i = 0; i < image_header(map)->file_count && search.found < 0; i++) {
+        matchImageName(i, &search);
+    }
+    return search.found;
+}
+
+int compare_exts_by_bytes(const void *a, const void *b) {
+    int64_t x = (*(const struct image_ext **) a)->bytes;
+    int64_t y = (*(const struct image_ext **) b)->bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// text for w24stats
+void index_stats(char *buffer, size_t size) {
+    struct image_map *map = image_acquire();
+    if (map == NULL) {
+        snprintf(buffer, size, "file index: not ready\n");
+        return;
+    }
+    const struct image_header *header = image_header(map);
+    size_t length = snprintf(buffer, size, "file index: %u files, generation %llu from pid %d%s\n"
+                                           "path trigrams: %u, postings: %llu\n",
+                             header->file_count, (unsigned long long) header->generation, shared.control->writer,
+                             shared.writer ? " (this server)" : "", header->trigram_count, (unsigned long long) header->posting_count);
+
+    int top = 20;
+    const struct image_ext **exts = malloc((header->ext_count + 1) * sizeof(struct image_ext *));
+    if (exts != NULL && length < size) {
+        for (uint32_t i = 0; i < header->ext_count; i++) {
+            exts[i] = (const struct image_ext *) (map->base + header->exts) + i;
+        }
+        qsort(exts, header->ext_count, sizeof(exts[0]), compare_exts_by_bytes);
+        int n = header->ext_count;
+        length += snprintf(buffer + length, size - length, "extensions: %d (largest %d)\n", n, n < top ? n : top);
+        for (int i = 0; i < n && i < top && length < size; i++) {
+            length += snprintf(buffer + length, size - length, "  .%s : %u files, %lld bytes\n", exts[i]->ext, exts[i]->count, (long long) exts[i]->bytes);
+        }
+    }
+    free(exts);
+    image_release(map);
+}
+
+// runs in the server process : wait for the index lock if another server holds it,
+// load or build the index, publish it and keep it current
+void *index_writer_thread(void *arg) {
+    (void) arg;
+    if (flock(shared.control_fd, LOCK_EX | LOCK_NB) < 0) {
+        printf("file index kept by pid %d, standing by\n", shared.control->writer);
+        fflush(stdout);
+        while (flock(shared.control_fd, LOCK_EX) < 0) {
+            if (errno != EINTR) {
+                perror("error: index lock");
+                return NULL;
+            }
+        }
+        printf("taking over the file index\n");
+    }
+    shared.writer = 1;
+    shared.control->writer = getpid();
+
+    struct dir_list dirs = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0};
+    if (load_file_index(&dirs) == EXIT_FAILURE) {
+        // a failed walk leaves nothing behind, it is tried again a few times
+        int status;
+        for (int attempt = 1; (status = build_file_index(&dirs)) == EXIT_FAILURE && attempt < INDEX_BUILD_ATTEMPTS; attempt++) {
+            sleep(attempt);
+        }
+        if (status == EXIT_SUCCESS) {
+            save_index_snapshot(&dirs);
+        }
+    }
+    if (!file_index.ready || publish_index_image() == EXIT_FAILURE) {
+        fprintf(stderr, "error: file index not published\n");
+        fflush(stdout);
+        dir_list_free(&dirs);
+        return NULL;
+    }
+    fflush(stdout);
+
+    // the directories as read by the startup walk are the starting point for polling
+    if (poll_interval > 0 || watch_files() == EXIT_FAILURE) {
+        poll_files(&dirs, poll_interval > 0 ? poll_interval : DEFAULT_POLL_INTERVAL);
+    }
+    dir_list_free(&dirs);
+    return NULL;
+}
+
+int start_index_writer() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, index_writer_thread, NULL) != 0) {
+        perror("error: starting index writer");
+        return EXIT_FAILURE;
+    }
+    pthread_detach(thread);
+    return EXIT_SUCCESS;
+}
+
+//////////////////////////// SHARED INDEX END ///////////////////////////////////////
+
+//////////////////////////// PAGED LISTINGS START ///////////////////////////////////////
+
+// dirlist and w24fn -p answer a page at a time. The rest of the listing is kept by the
+// session, a page with more to come ends with "cursor: <token>" and "w24next <token>"
+// returns the next one. One listing per session, starting another one drops it
+
+#define DEFAULT_PAGE_LINES 1000 // dirlist without -p
+
+#define LISTING_DIRS 1   // dirlist : the directory names, sorted once
+#define LISTING_SEARCH 2 // w24fn -p : matches in the index image
+
+struct listing {
+    int type;
+    unsigned long id;
+    long page; // pages sent so far, part of the cursor
+    int page_size;
+
+    // LISTING_DIRS
+    char **names;
+    long name_count;
+    long next_name;
+
+    // LISTING_SEARCH, the image stays pinned so every page sees the same files
+    struct image_map *image;
+    char name[CMD_BUFFER_SIZE];
+    int next_entry; // -1 once every match is sent
+};
+
+// text response built piece by piece
+struct text_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+int text_printf(struct text_buffer *text, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (needed < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (text->length + needed + 1 > text->capacity) {
+        size_t capacity = text->capacity == 0 ? CHUNK_SIZE_TEXT : text->capacity;
+        while (capacity < text->length + needed + 1) {
+            capacity *= 2;
+        }
+        char *data = realloc(text->data, capacity);
+        if (data == NULL) {
+            perror("error: allocating response\n");
+            return EXIT_FAILURE;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+
+    va_start(args, format);
+    vsnprintf(text->data + text->length, needed + 1, format, args);
+    va_end(args);
+    text->length += needed;
+    return EXIT_SUCCESS;
+}
+
+struct listing *create_listing(int type, int page_size) {
+    static unsigned long next_listing_id = 0;
+
+    struct listing *listing = calloc(1, sizeof(struct listing));
+    if (listing == NULL) {
+        perror("error: allocating listing\n");
+        return NULL;
+    }
+
+    listing->type = type;
+    listing->id = __atomic_add_fetch(&next_listing_id, 1, __ATOMIC_RELAXED);
+    listing->page_size = page_size;
+    return listing;
+}
+
+void free_listing(struct listing *listing) {
+    if (listing == NULL) {
+        return;
+    }
+    for (long i = 0; i < listing->name_count; i++) {
+        free(listing->names[i]);
+    }
+    free(listing->names);
+    if (listing->image != NULL) {
+        image_release(listing->image);
+    }
+    free(listing);
+}
+
+// token of the next page, only the session that opened the listing knows it
+void listing_cursor(const struct listing *listing, char *cursor, size_t size) {
+    snprintf(cursor, size, "%x-%lx-%lx", worker_id, listing->id, listing->page);
+}
+
+// close a page, with the cursor line when more is left
+int end_page(struct listing *listing, int more, struct text_buffer *text) {
+    listing->page++;
+    if (!more) {
+        return EXIT_SUCCESS;
+    }
+
+    char cursor[64];
+    listing_cursor(listing, cursor, sizeof(cursor));
+    return text_printf(text, "cursor: %s\n", cursor);
+}
+
+#define DIRLIST_BY_NAME 1 // dirlist -a
+#define DIRLIST_BY_TIME 2 // dirlist -t : birth time, mtime where the file system has none
+
+struct directory_name {
+    char *name;
+    time_t time;
+};
+
+int compare_directory_names(const void *a, const void *b) {
+    return strcmp(((const struct directory_name *) a)->name, ((const struct directory_name *) b)->name);
+}
+
+int compare_directory_times(const void *a, const void *b) {
+    const struct directory_name *dir1 = a;
+    const struct directory_name *dir2 = b;
+    if (dir1->time != dir2->time) {
+        return dir1->time < dir2->time ? -1 : 1;
+    }
+    return strcmp(dir1->name, dir2->name);
+}
+
+// the directories in the home directory, read with getdents64() and sorted in memory;
+// entries are only stat'ed for their times or when the file system has no d_type
+// NULL when the directory can not be read
+struct listing *list_directories(int order, int page_size) {
+    struct listing *listing = create_listing(LISTING_DIRS, page_size);
+    if (listing == NULL) {
+        return NULL;
+    }
+
+    struct passwd *pw = getpwuid(getuid());
+    int fd = pw == NULL ? -1 : open(pw->pw_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *buffer = fd < 0 ? NULL : malloc(SCAN_BUFFER_SIZE);
+    if (buffer == NULL) {
+        perror("error: reading home directory");
+        if (fd >= 0) {
+            close(fd);
+        }
+        free_listing(listing);
+        return NULL;
+    }
+
+    struct directory_name *dirs = NULL;
+    long count = 0;
+    long capacity = 0;
+    int failed = 0;
+    long n;
+    while (!failed && (n = syscall(SYS_getdents64, fd, buffer, SCAN_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < n && !failed;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (buffer + offset);
+            offset += d->d_reclen;
+
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 ||
+                (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN)) {
+                continue;
+            }
+
+            time_t time = 0;
+            if (d->d_type == DT_UNKNOWN || order == DIRLIST_BY_TIME) {
+                struct stat sb;
+                time_t btime;
+                if (scan_stat(fd, d->d_name, 0, &sb, &btime) < 0 || !S_ISDIR(sb.st_mode)) {
+                    continue;
+                }
+                time = btime >= 0 ? btime : sb.st_mtime;
+            }
+
+            if (count == capacity) {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                struct directory_name *grown = realloc(dirs, capacity * sizeof(struct directory_name));
+                if (grown == NULL) {
+                    failed = 1;
+                    break;
+                }
+                dirs = grown;
+            }
+            dirs[count].time = time;
+            if ((dirs[count].name = strdup(d->d_name)) == NULL) {
+                failed = 1;
+                break;
+            }
+            count++;
+        }
+    }
+    close(fd);
+    free(buffer);
+
+    if (!failed && count > 0 && (listing->names = malloc(count * sizeof(char *))) == NULL) {
+        failed = 1;
+    }
+    if (failed) {
+        perror("error: allocating directory list\n");
+        for (long i = 0; i < count; i++) {
+            free(dirs[i].name);
+        }
+        free(dirs);
+        free_listing(listing);
+        return NULL;
+    }
+
+    qsort(dirs, count, sizeof(struct directory_name), order == DIRLIST_BY_TIME ? compare_directory_times : compare_directory_names);
+    for (long i = 0; i < count; i++) {
+        listing->names[i] = dirs[i].name;
+    }
+    listing->name_count = count;
+    free(dirs);
+    return listing;
+}
+
+// next page of a dirlist, EXIT_FAILURE when out of memory
+int directories_page(struct listing *listing, struct text_buffer *text) {
+    long end = listing->next_name + listing->page_size;
+    if (end > listing->name_count) {
+        end = listing->name_count;
+    }
+
+    // sized for the page and the cursor line up front
+    size_t size = 64;
+    for (long i = listing->next_name; i < end; i++) {
+        size += strlen(listing->names[i]) + 1;
+    }
+    if ((text->data = malloc(size)) == NULL) {
+        perror("error: allocating response\n");
+        return EXIT_FAILURE;
+    }
+    text->capacity = size;
+    text->data[0] = '\0';
+
+    for (long i = listing->next_name; i < end; i++) {
+        size_t length = strlen(listing->names[i]);
+        memcpy(text->data + text->length, listing->names[i], length);
+        text->data[text->length + length] = '\n';
+        text->length += length + 1;
+    }
+    text->data[text->length] = '\0';
+    listing->next_name = end;
+    return end_page(listing, end < listing->name_count, text);
+}
+
+//////////////////////////// PAGED LISTINGS END ///////////////////////////////////////
+
+///////////////// cmd 3 START ////////////////////////
+
+// the response block of one file
+int print_match(const struct image_map *map, int entry, struct text_buffer *text) {
+    const struct snapshot_file *file = image_file(map, entry);
+    const char *path = image_path(map, entry);
+    time_t ctime = file->ctime;
+    char created[32];
+
+    return text_printf(text, "Filename: %s\nPath:%s\nSize: %ld bytes\nDate created: %sPermissions: %o\n",
+                       path + file->name_offset, path, (long) file->size, ctime_r(&ctime, created),
+                       file->mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+struct search_page {
+    struct listing *listing;
+    struct text_buffer *text;
+    int matches;
+    int next; // first match of the next page
+    int failed;
+};
+
+// print the matches of a page, stops at the first match of the next one
+int matchPageName(int entry, void *arg) {
+    struct search_page *page = arg;
+    struct listing *listing = page->listing;
+    if (!strContains((char *) image_path(listing->image, entry), listing->name)) {
+        return 0;
+    }
+    if (page->matches == listing->page_size) {
+        page->next = entry;
+        return 1;
+    }
+
+    page->matches++;
+    if (print_match(listing->image, entry, page->text) == EXIT_FAILURE) {
+        page->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// next page of a w24fn -p listing into job->text, only the matches of this page are visited;
+// the listing is freed with the last page
+void search_page(struct archive_job *job) {
+    struct listing *listing = job->listing;
+    struct text_buffer text = {NULL, 0, 0};
+    struct search_page page = {listing, &text, 0, -1, 0};
+
+    const char *trigram_name = listing->name + root_skip(listing->name);
+    if (image_trigram_candidates(listing->image, trigram_name, listing->next_entry, matchPageName, &page) < 0) {
+        uint32_t file_count = image_header(listing->image)->file_count;
+        for (uint32_t i = listing->next_entry; i < file_count && page.next < 0 && !page.failed; i++) {
+            matchPageName(i, &page);
+        }
+    }
+    listing->next_entry = page.next;
+
+    if (page.failed || end_page(listing, page.next >= 0, &text) == EXIT_FAILURE) {
+        free(text.data);
+        job->text = strdup("error: server out of memory\n");
+    } else if (text.data == NULL) {
+        // File not found in the directory tree
+        job->text = strdup("File not found\n");
+    } else {
+        job->text = text.data;
+    }
+
+    if (listing->next_entry < 0 || page.failed) {
+        free_listing(listing);
+        job->listing = NULL;
+    }
+}
+
+// search for the file in the shared index image, the response is left in job->text
+// with -p every match is listed, page_size files per page
+int search_file(struct archive_job *job) {
+    struct image_map *map = image_acquire();
+    if (map == NULL) {
+        // Failed to traverse directory tree
+        job->text = strdup("error: failed to traverse directory tree\n");
+        return -1;
+    }
+
+    if (job->page_size > 0) {
+        job->listing = create_listing(LISTING_SEARCH, job->page_size);
+        if (job->listing == NULL) {
+            image_release(map);
+            job->text = strdup("error: server out of memory\n");
+            return -1;
+        }
+        job->listing->image = map;
+        snprintf(job->listing->name, sizeof(job->listing->name), "%s", job->args);
+        search_page(job);
+        return 0;
+    }
+
+    // first matching entry from the trigram index, short names and names inside the
+    // export directory prefix are scanned for
+    int found = image_find_name(map, job->args);
+    if (found >= 0) {
+        // file found, send its information to the client
+        struct text_buffer text = {NULL, 0, 0};
+        if (print_match(map, found, &text) == EXIT_SUCCESS) {
+            job->text = text.data;
+        } else {
+            free(text.data);
+            job->text = strdup("error: server out of memory\n");
+        }
+    }
+    image_release(map);
+
+    if (job->text == NULL) {
+        // File not found in the directory tree
+        job->text = strdup("File not found\n");
+    }
+
+    return 0;
+}
+
+///////////////// cmd 3 END ///////////////////////////
+
+///////////////// cmd 4 START ////////////////////////
+
+int create_file_list(off_t size11, off_t size22) {
+    current_job->size1 = size11;
+    current_job->size2 = size22;
+
+    // files with size1 <= size <= size2 from the size index
+    return index_collect_range(KEY_SIZE, size11, size22, ORDER_INDEX);
+}
+
+///////////////// cmd 4 END ///////////////////////////
+
+///////////////// cmd 5 START /////////////////////////
+
+int create_file_list_on_file_types(char *file_types_str) {
+    const char *delimiters = " ";
+    char *save_ptr;
+    char *fType = strtok_r(file_types_str, delimiters, &save_ptr);
+
+    while (fType != NULL && current_job->num_file_types < MAX_FILE_TYPES) {
+        strcpy(current_job->file_types[current_job->num_file_types], fType);
+        current_job->num_file_types++;
+        fType = strtok_r(NULL, delimiters, &save_ptr);
+    }
+
+    // extensions are matched case-insensitively through the extension index
+    return index_collect_extensions(current_job->file_types, current_job->num_file_types);
+}
+
+///////////////// cmd 5 END ///////////////////////////
+
+///////////////// cmd 6 & 7 START /////////////////////
+
+int parse_date(const char *date_str, time_t *date) {
+    struct tm date_tm;
+    memset(&date_tm, 0, sizeof(struct tm));
+    char *end = strptime(date_str, "%Y-%m-%d", &date_tm);
+    if (end == NULL || *end != '\0') {
+        fprintf(stderr, "error : parsing date string: %s\n", date_str);
+        return EXIT_FAILURE;
+    }
+    *date = mktime(&date_tm);
+    return EXIT_SUCCESS;
+}
+
+// create file list based on provided date and type of comparison
+// type -> 1 : before or equal, 2 : after or equal (up to an optional second date)
+// options : -t mtime|ctime|btime (default mtime), -o newest|oldest (default index order)
+int create_file_list_on_date(char *date_str, int type) {
+    const char *delimiters = " ";
+    char *save_ptr;
+    char *dates[2];
+    int date_count = 0;
+    current_job->time_key = KEY_MTIME;
+    current_job->time_order = ORDER_INDEX;
+
+    for (char *token = strtok_r(date_str, delimiters, &save_ptr); token != NULL; token = strtok_r(NULL, delimiters, &save_ptr)) {
+        if (strcmp(token, "-t") == 0 || strcmp(token, "-o") == 0) {
+            char *value = strtok_r(NULL, delimiters, &save_ptr);
+            if (value == NULL) {
+                break;
+            }
+            if (token[1] == 't') {
+                current_job->time_key = strcmp(value, "ctime") == 0 ? KEY_CTIME : strcmp(value, "btime") == 0 ? KEY_BTIME :
+                                        strcmp(value, "mtime") == 0 ? KEY_MTIME : -1;
+            } else {
+                current_job->time_order = strcmp(value, "newest") == 0 ? ORDER_NEWEST : strcmp(value, "oldest") == 0 ? ORDER_OLDEST : -1;
+            }
+            if (current_job->time_key < 0 || current_job->time_order < 0) {
+                current_job->text = strdup("error: use -t mtime|ctime|btime and -o newest|oldest\n");
+                return EXIT_FAILURE;
+            }
+        } else if (date_count < 2) {
+            dates[date_count++] = token;
+        }
+    }
+
+    time_t low = INT64_MIN;
+    time_t high = INT64_MAX;
+    if (date_count == 0 || (date_count == 2 && type == 1) ||
+        parse_date(dates[0], type == 1 ? &high : &low) == EXIT_FAILURE ||
+        (date_count == 2 && parse_date(dates[1], &high) == EXIT_FAILURE)) {
+        return EXIT_FAILURE;
+    }
+    current_job->before_date_time = high;
+    current_job->after_date_time = low;
+
+    // before : time <= date, after : date <= time (<= second date)
+    return index_collect_range(current_job->time_key, low, high, current_job->time_order);
+}
+
+///////////////// cmd 6 & 7 END ////////////////////////
+
+///////////////// cmd 9 START ////////////////////////
+
+// w24fq : files matching all of the predicates, e.g.
+//   w24fq type=pdf size>=1M size<=10M mtime>=2024-03-01
+//   size|mtime|ctime|btime with >= <= > < =, sizes take K, M, G, dates are YYYY-mm-dd
+//   type=ext[,ext...]  name~text (part of the path, like w24fn)
+// the planner starts from the access path with the fewest candidates (a key range,
+// the extension postings, the trigram postings of a name, or every file) and runs the
+// other predicates over those candidates as one filter pipeline
+
+#define MAX_QUERY_NAMES 4
+
+#define PLAN_SCAN 0
+#define PLAN_RANGE 1
+#define PLAN_TYPES 2
+#define PLAN_NAME 3
+
+const char *plan_names[] = {"scan", "range", "types", "name"};
+const char *key_names[] = {"size", "mtime", "ctime", "btime"};
+
+struct query {
+    int64_t low[ORDERED_KEYS];
+    int64_t high[ORDERED_KEYS];
+    int bounded[ORDERED_KEYS];
+    char exts[MAX_FILE_TYPES][MAX_EXTENSION_LENGTH + 1];
+    int ext_count; // -1 : no type predicate
+    const char *names[MAX_QUERY_NAMES];
+    int name_count;
+};
+
+// one predicate of the pipeline, arg : the key or the name
+typedef int (*query_filter)(const struct query *query, const struct image_map *map, int entry, int arg);
+
+struct query_stage {
+    query_filter filter;
+    int arg;
+};
+
+struct query_plan {
+    const struct query *query;
+    const struct image_map *map;
+    int access; // PLAN_...
+    int arg; // key of PLAN_RANGE, name of PLAN_NAME
+    long candidates; // estimate
+    struct query_stage stages[ORDERED_KEYS + 1 + MAX_QUERY_NAMES];
+    int stage_count;
+    int in_order; // candidates come in index order, the query stops at the job's limit
+    int status; // EXIT_FAILURE : out of memory
+};
+
+int matchKeyRange(const struct query *query, const struct image_map *map, int entry, int key) {
+    int64_t value = image_key(map, entry, key);
+    // no birth time : outside every btime range
+    return (key != KEY_BTIME || value >= 0) && value >= query->low[key] && value <= query->high[key];
+}
+
+int matchTypes(const struct query *query, const struct image_map *map, int entry, int arg) {
+    (void) arg;
+    char ext[MAX_EXTENSION_LENGTH + 1];
+    const char *path = image_path(map, entry);
+    if (!file_extension(path + image_file(map, entry)->name_offset, ext)) {
+        return 0;
+    }
+    for (int i = 0; i < query->ext_count; i++) {
+        if (strcmp(ext, query->exts[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int matchName(const struct query *query, const struct image_map *map, int entry, int name) {
+    return strContains((char *) image_path(map, entry), (char *) query->names[name]);
+}
+
+// a size with an optional K, M or G suffix
+int parse_size(const char *text, int64_t *size) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0) {
+        return EXIT_FAILURE;
+    }
+    int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+    if (shift > 0) {
+        end++;
+    }
+    // the shifted value has to stay representable
+    if (*end != '\0' || value > (INT64_MAX >> shift)) {
+        return EXIT_FAILURE;
+    }
+    *size = (int64_t) value << shift;
+    return EXIT_SUCCESS;
+}
+
+// narrow the range of key by "op value"; a date = is the whole day
+void bound_key(struct query *query, int key, const char *op, int64_t value) {
+    int64_t low = value;
+    int64_t high = value;
+    if (strcmp(op, ">") == 0) {
+        low = value == INT64_MAX ? value : value + 1;
+        high = INT64_MAX;
+    } else if (strcmp(op, ">=") == 0) {
+        high = INT64_MAX;
+    } else if (strcmp(op, "<") == 0) {
+        low = INT64_MIN;
+        high = value == INT64_MIN ? value : value - 1;
+    } else if (strcmp(op, "<=") == 0) {
+        low = INT64_MIN;
+    } else if (key != KEY_SIZE) {
+        high = value + 24 * 60 * 60 - 1;
+    }
+    query->low[key] = low > query->low[key] ? low : query->low[key];
+    query->high[key] = high < query->high[key] ? high : query->high[key];
+    query->bounded[key] = 1;
+}
+
+// parse one term of the query; EXIT_FAILURE on a term it does not know
+int parse_query_term(char *term, struct query *query) {
+    size_t field_length = strcspn(term, "<>=~");
+    char *op = term + field_length;
+    size_t op_length = strspn(op, "<>=~");
+    char *value = op + op_length;
+    if (field_length == 0 || op_length == 0 || op_length > 2 || *value == '\0') {
+        return EXIT_FAILURE;
+    }
+    char op_text[3];
+    memcpy(op_text, op, op_length);
+    op_text[op_length] = '\0';
+    *op = '\0';
+
+    if (strcmp(term, "name") == 0) {
+        if (strcmp(op_text, "~") != 0 || query->name_count == MAX_QUERY_NAMES) {
+            return EXIT_FAILURE;
+        }
+        query->names[query->name_count++] = value;
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(term, "type") == 0) {
+        if (strcmp(op_text, "=") != 0) {
+            return EXIT_FAILURE;
+        }
+        // several type terms : any of their extensions
+        query->ext_count = query->ext_count < 0 ? 0 : query->ext_count;
+        char *save_ptr;
+        for (char *ext = strtok_r(value, ",", &save_ptr); ext != NULL; ext = strtok_r(NULL, ",", &save_ptr)) {
+            if (query->ext_count == MAX_FILE_TYPES || !fold_extension(ext, query->exts[query->ext_count])) {
+                return EXIT_FAILURE;
+            }
+            query->ext_count++;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    int key = -1;
+    for (int i = 0; i < ORDERED_KEYS; i++) {
+        if (strcmp(term, key_names[i]) == 0) {
+            key = i;
+        }
+    }
+    const char *ops[] = {">=", "<=", ">", "<", "="};
+    int known_op = 0;
+    for (int i = 0; i < 5; i++) {
+        known_op |= strcmp(op_text, ops[i]) == 0;
+    }
+    if (key < 0 || !known_op) {
+        return EXIT_FAILURE;
+    }
+    int64_t bound;
+    time_t date;
+    if (key == KEY_SIZE ? parse_size(value, &bound) == EXIT_FAILURE : parse_date(value, &date) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    bound_key(query, key, op_text, key == KEY_SIZE ? bound : (int64_t) date);
+    return EXIT_SUCCESS;
+}
+
+// pick the access path with the fewest candidates, the other predicates become the pipeline
+void plan_query(struct query_plan *plan) {
+    const struct query *query = plan->query;
+    const struct image_map *map = plan->map;
+    plan->access = PLAN_SCAN;
+    plan->candidates = image_header(map)->file_count;
+
+    for (int key = 0; key < ORDERED_KEYS; key++) {
+        if (!query->bounded[key]) {
+            continue;
+        }
+        long count = 0;
+        if (query->low[key] <= query->high[key]) {
+            long end = query->high[key] == INT64_MAX ? (long) image_header(map)->ordered_count[key] : image_lower_bound(map, key, query->high[key] + 1);
+            count = end - image_lower_bound(map, key, query->low[key]);
+        }
+        if (count < plan->candidates) {
+            plan->access = PLAN_RANGE;
+            plan->arg = key;
+            plan->candidates = count;
+        }
+    }
+    if (query->ext_count >= 0) {
+        long count = 0;
+        for (int i = 0; i < query->ext_count; i++) {
+            const struct image_ext *list = image_find_ext(map, query->exts[i]);
+            count += list == NULL ? 0 : list->count;
+        }
+        if (count < plan->candidates) {
+            plan->access = PLAN_TYPES;
+            plan->candidates = count;
+        }
+    }
+    for (int i = 0; i < query->name_count; i++) {
+        long count = image_trigram_estimate(map, query->names[i] + root_skip(query->names[i]));
+        if (count >= 0 && count < plan->candidates) {
+            plan->access = PLAN_NAME;
+            plan->arg = i;
+            plan->candidates = count;
+        }
+    }
+
+    // cheap comparisons first, the path compares last
+    plan->stage_count = 0;
+    for (int key = 0; key < ORDERED_KEYS; key++) {
+        if (query->bounded[key] && !(plan->access == PLAN_RANGE && plan->arg == key)) {
+            plan->stages[plan->stage_count++] = (struct query_stage) {matchKeyRange, key};
+        }
+    }
+    if (query->ext_count >= 0 && plan->access != PLAN_TYPES) {
+        plan->stages[plan->stage_count++] = (struct query_stage) {matchTypes, 0};
+    }
+    // the trigrams of a name do not prove the match, its candidates are compared too
+    for (int i = 0; i < query->name_count; i++) {
+        plan->stages[plan->stage_count++] = (struct query_stage) {matchName, i};
+    }
+    plan->in_order = plan->access != PLAN_RANGE;
+}
+
+// runs the pipeline on a candidate, stops the access path once the result is complete
+int queryCandidate(int entry, void *arg) {
+    struct query_plan *plan = arg;
+    for (int i = 0; i < plan->stage_count; i++) {
+        if (!plan->stages[i].filter(plan->query, plan->map, entry, plan->stages[i].arg)) {
+            return 0;
+        }
+    }
+    if (!plan->in_order) {
+        plan->status = result_select(current_job, entry);
+        return plan->status == EXIT_FAILURE;
+    }
+    plan->status = result_add(current_job, entry);
+    return plan->status == EXIT_FAILURE || result_full(current_job);
+}
+
+void run_query_plan(struct query_plan *plan) {
+    const struct image_map *map = plan->map;
+    const struct query *query = plan->query;
+    if (plan->access == PLAN_SCAN) {
+        for (uint32_t i = 0; i < image_header(map)->file_count && !queryCandidate(i, plan); i++);
+    } else if (plan->access == PLAN_RANGE && plan->candidates > 0) {
+        const int *sorted = (const int *) (map->base + image_header(map)->ordered[plan->arg]);
+        long first = image_lower_bound(map, plan->arg, query->low[plan->arg]);
+        for (long i = first; i < first + plan->candidates && !queryCandidate(sorted[i], plan); i++);
+        result_sort(current_job);
+    } else if (plan->access == PLAN_TYPES) {
+        // merge the posting lists, the same extension twice gives the same entries
+        const int *postings = (const int *) (map->base + image_header(map)->postings);
+        const struct image_ext *lists[MAX_FILE_TYPES];
+        uint32_t positions[MAX_FILE_TYPES] = {0};
+        for (int i = 0; i < query->ext_count; i++) {
+            lists[i] = image_find_ext(map, query->exts[i]);
+        }
+        int last = -1;
+        while (1) {
+            int best = -1;
+            for (int i = 0; i < query->ext_count; i++) {
+                if (lists[i] != NULL && positions[i] < lists[i]->count &&
+                    (best < 0 || postings[lists[i]->first + positions[i]] < postings[lists[best]->first + positions[best]])) {
+                    best = i;
+                }
+            }
+            if (best < 0) {
+                break;
+            }
+            int entry = postings[lists[best]->first + positions[best]++];
+            if (entry != last && queryCandidate(entry, plan)) {
+                break;
+            }
+            last = entry;
+        }
+    } else if (plan->access == PLAN_NAME) {
+        const char *name = query->names[plan->arg];
+        image_trigram_candidates(map, name + root_skip(name), 0, queryCandidate, plan);
+    }
+}
+
+int create_file_list_on_query(char *query_str) {
+    struct query query;
+    memset(&query, 0, sizeof(query));
+    for (int key = 0; key < ORDERED_KEYS; key++) {
+        query.low[key] = INT64_MIN;
+        query.high[key] = INT64_MAX;
+    }
+    query.ext_count = -1;
+
+    const char *delimiters = " ";
+    char *save_ptr;
+    int terms = 0;
+    for (char *term = strtok_r(query_str, delimiters, &save_ptr); term != NULL; term = strtok_r(NULL, delimiters, &save_ptr)) {
+        char original[CMD_BUFFER_SIZE];
+        snprintf(original, sizeof(original), "%s", term);
+        if (parse_query_term(term, &query) == EXIT_FAILURE) {
+            char response[CMD_BUFFER_SIZE + 128];
+            snprintf(response, sizeof(response), "error: invalid query term %s, use size|mtime|ctime|btime<op>value (op: >= <= > < =), "
+                                                 "type=ext[,ext], name~text\n", original);
+            current_job->text = strdup(response);
+            return EXIT_FAILURE;
+        }
+        terms++;
+    }
+    if (terms == 0) {
+        current_job->text = strdup("error: empty query\n");
+        return EXIT_FAILURE;
+    }
+
+    struct image_map *map = result_image(current_job);
+    if (map == NULL) {
+        return EXIT_FAILURE;
+    }
+    struct query_plan plan;
+    plan.query = &query;
+    plan.map = map;
+    plan.status = EXIT_SUCCESS;
+    plan_query(&plan);
+    printf("query plan : %s%s%s, %ld candidates, %d filters\n", plan_names[plan.access],
+           plan.access == PLAN_RANGE ? " on " : "", plan.access == PLAN_RANGE ? key_names[plan.arg] : "", plan.candidates, plan.stage_count);
+    run_query_plan(&plan);
+
+    return plan.status == EXIT_SUCCESS && current_job->file_count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+///////////////// cmd 9 END ///////////////////////////
+
+//////////////////////////// PARALLEL COMPRESSION START ///////////////////////////////////////
+
+// pigz style compression : every block is raw deflated on its own thread with the
+// previous 32 KB as dictionary and ends on a byte boundary (Z_SYNC_FLUSH), so the
+// blocks concatenate into one ordinary gzip member, the CRCs are combined in order
+// (zstd / lz4 blocks are independent frames, "none" skips the threads)
+
+// publishes archive bytes written so far to a streaming session, see the thread pool
+void report_archive_progress(off_t written);
+
+// write a whole buffer, retrying short writes
+int write_all(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return EXIT_FAILURE;
+        }
+        p += n;
+        length -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+struct tar_writer;
+
+struct archive_block {
+    struct tar_writer *tw;
+    struct archive_block *next; // compression queue
+
+    unsigned char *in;
+    size_t in_len;
+    unsigned char dict[GZ_DICT_SIZE];
+    size_t dict_len;
+    int last;  // ends the deflate stream (Z_FINISH)
+    int codec;
+    int level;
+
+    unsigned char *out;
+    size_t out_len;
+    unsigned long crc;
+    int done;
+    int failed;
+};
+
+struct compress_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_blocks;
+    struct archive_block *head;
+    struct archive_block *tail;
+};
+
+struct compress_pool compress_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL};
+
+// TAR stream being written through the compression threads into an output descriptor
+struct tar_writer {
+    int out_fd;
+    off_t written; // compressed bytes written to out_fd
+    int codec;
+    int level;
+
+    // current block holds incompressible members, it is stored instead of compressed
+    int stored;
+    int stored_files;
+    off_t stored_bytes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t block_done;
+
+    // blocks in stream order, oldest first
+    struct archive_block *inflight[MAX_INFLIGHT_BLOCKS];
+    int inflight_head;
+    int inflight_count;
+
+    // block being filled and the dictionary for it
+    unsigned char *block;
+    size_t block_len;
+    unsigned char dict[GZ_DICT_SIZE];
+    size_t dict_len;
+
+    unsigned long crc;
+    unsigned long total_in;
+};
+
+// raw deflate one block, the stream of each compression thread is reused
+void deflate_block(struct archive_block *b) {
+    static __thread z_stream *zs = NULL;
+    static __thread int zs_level;
+
+    if (zs == NULL) {
+        zs = calloc(1, sizeof(z_stream));
+        if (zs == NULL || deflateInit2(zs, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "error: deflateInit2 failed\n");
+            free(zs);
+            zs = NULL;
+            b->failed = 1;
+            return;
+        }
+        zs_level = b->level;
+    }
+
+    deflateReset(zs);
+    if (zs_level != b->level) {
+        deflateParams(zs, b->level, Z_DEFAULT_STRATEGY);
+        zs_level = b->level;
+    }
+    if (b->dict_len > 0) {
+        deflateSetDictionary(zs, b->dict, b->dict_len);
+    }
+
+    size_t capacity = deflateBound(zs, b->in_len) + 64;
+    b->out = malloc(capacity);
+    if (b->out == NULL) {
+        b->failed = 1;
+        return;
+    }
+
+    zs->next_in = b->in;
+    zs->avail_in = b->in_len;
+    zs->next_out = b->out;
+    zs->avail_out = capacity;
+
+    int ret;
+    while (1) {
+        ret = deflate(zs, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            b->failed = 1;
+            return;
+        }
+        if (zs->avail_out > 0 && zs->avail_in == 0 && (!b->last || ret == Z_STREAM_END)) {
+            break;
+        }
+
+        // out of space, grow and continue
+        size_t used = capacity - zs->avail_out;
+        unsigned char *grown = realloc(b->out, capacity * 2);
+        if (grown == NULL) {
+            b->failed = 1;
+            return;
+        }
+        b->out = grown;
+        zs->next_out = b->out + used;
+        zs->avail_out = capacity * 2 - used;
+        capacity *= 2;
+    }
+
+    b->out_len = capacity - zs->avail_out;
+    b->crc = crc32(0L, b->in, b->in_len);
+}
+
+// zstd and lz4 blocks are complete frames, decoders read concatenated frames as one stream
+#ifdef WITH_ZSTD
+void zstd_block(struct archive_block *b) {
+    static __thread ZSTD_CCtx *cctx = NULL;
+    if (cctx == NULL && (cctx = ZSTD_createCCtx()) == NULL) {
+        b->failed = 1;
+        return;
+    }
+
+    size_t capacity = ZSTD_compressBound(b->in_len);
+    if ((b->out = malloc(capacity)) == NULL) {
+        b->failed = 1;
+        return;
+    }
+
+    size_t n = ZSTD_compressCCtx(cctx, b->out, capacity, b->in, b->in_len, b->level);
+    if (ZSTD_isError(n)) {
+        fprintf(stderr, "error: zstd : %s\n", ZSTD_getErrorName(n));
+        b->failed = 1;
+        return;
+    }
+    b->out_len = n;
+}
+#endif
+
+#ifdef WITH_LZ4
+void lz4_block(struct archive_block *b) {
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = b->level;
+    prefs.frameInfo.contentSize = b->in_len;
+
+    size_t capacity = LZ4F_compressFrameBound(b->in_len, &prefs);
+    if ((b->out = malloc(capacity)) == NULL) {
+        b->failed = 1;
+        return;
+    }
+
+    size_t n = LZ4F_compressFrame(b->out, capacity, b->in, b->in_len, &prefs);
+    if (LZ4F_isError(n)) {
+        fprintf(stderr, "error: lz4 : %s\n", LZ4F_getErrorName(n));
+        b->failed = 1;
+        return;
+    }
+    b->out_len = n;
+}
+#endif
+
+void compress_block(struct archive_block *b) {
+#ifdef WITH_ZSTD
+    if (b->codec == CODEC_ZSTD) {
+        zstd_block(b);
+        return;
+    }
+#endif
+#ifdef WITH_LZ4
+    if (b->codec == CODEC_LZ4) {
+        lz4_block(b);
+        return;
+    }
+#endif
+    deflate_block(b);
+}
+
+void *compress_thread(void *arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&compress_pool.lock);
+        while (compress_pool.head == NULL) {
+            pthread_cond_wait(&compress_pool.has_blocks, &compress_pool.lock);
+        }
+        struct archive_block *b = compress_pool.head;
+        compress_pool.head = b->next;
+        if (compress_pool.head == NULL) {
+            compress_pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&compress_pool.lock);
+
+        compress_block(b);
+
+        pthread_mutex_lock(&b->tw->lock);
+        b->done = 1;
+        pthread_cond_broadcast(&b->tw->block_done);
+        pthread_mutex_unlock(&b->tw->lock);
+    }
+    return NULL;
+}
+
+int start_compress_pool(int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, compress_thread, NULL) != 0) {
+            perror("error: starting compression thread");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    return EXIT_SUCCESS;
+}
+
+void free_archive_block(struct archive_block *b) {
+    free(b->in);
+    free(b->out);
+    free(b);
+}
+
+// wait for the oldest block, write it out and fold its CRC into the stream
+int write_oldest_block(struct tar_writer *tw) {
+    struct archive_block *b = tw->inflight[tw->inflight_head];
+
+    pthread_mutex_lock(&tw->lock);
+    while (!b->done) {
+        pthread_cond_wait(&tw->block_done, &tw->lock);
+    }
+    pthread_mutex_unlock(&tw->lock);
+
+    tw->inflight_head = (tw->inflight_head + 1) % MAX_INFLIGHT_BLOCKS;
+    tw->inflight_count--;
+
+    int status = EXIT_SUCCESS;
+    if (b->failed) {
+        fprintf(stderr, "error: compressing archive block failed\n");
+        status = EXIT_FAILURE;
+    } else if (write_all(tw->out_fd, b->out, b->out_len) == EXIT_FAILURE) {
+        perror("error: writing archive");
+        status = EXIT_FAILURE;
+    } else {
+        tw->written += b->out_len;
+        if (tw->codec == CODEC_GZIP) {
+            tw->crc = crc32_combine(tw->crc, b->crc, b->in_len);
+        }
+        report_archive_progress(tw->written);
+    }
+
+    free_archive_block(b);
+    return status;
+}
+
+// hand the filled block to the compression threads
+int submit_archive_block(struct tar_writer *tw, int last) {
+    if (tw->codec == CODEC_NONE) {
+        // uncompressed : written straight through, the buffer is reused
+        tw->total_in += tw->block_len;
+        if (write_all(tw->out_fd, tw->block, tw->block_len) == EXIT_FAILURE) {
+            perror("error: writing archive");
+            return EXIT_FAILURE;
+        }
+        tw->written += tw->block_len;
+        tw->block_len = 0;
+        report_archive_progress(tw->written);
+        return EXIT_SUCCESS;
+    }
+
+    struct archive_block *b = calloc(1, sizeof(struct archive_block));
+    if (b == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    b->tw = tw;
+    b->in = tw->block;
+    b->in_len = tw->block_len;
+    b->last = last;
+    b->codec = tw->codec;
+    // deflate level 0 emits stored blocks, the gzip stream stays valid
+    b->level = tw->stored ? (tw->codec == CODEC_ZSTD ? 1 : 0) : tw->level;
+    if (tw->codec == CODEC_GZIP) {
+        memcpy(b->dict, tw->dict, tw->dict_len);
+        b->dict_len = tw->dict_len;
+    }
+
+    // the last 32 KB seen so far become the dictionary of the next block
+    if (tw->codec != CODEC_GZIP) {
+        // independent frames, no dictionary
+    } else if (b->in_len >= GZ_DICT_SIZE) {
+        memcpy(tw->dict, b->in + b->in_len - GZ_DICT_SIZE, GZ_DICT_SIZE);
+        tw->dict_len = GZ_DICT_SIZE;
+    } else {
+        size_t keep = GZ_DICT_SIZE - b->in_len < tw->dict_len ? GZ_DICT_SIZE - b->in_len : tw->dict_len;
+        memmove(tw->dict, tw->dict + tw->dict_len - keep, keep);
+        memcpy(tw->dict + keep, b->in, b->in_len);
+        tw->dict_len = keep + b->in_len;
+    }
+    tw->total_in += b->in_len;
+
+    tw->block = NULL;
+    tw->block_len = 0;
+
+    // bound the memory of one archive : write out the oldest block first
+    if (tw->inflight_count == MAX_INFLIGHT_BLOCKS && write_oldest_block(tw) == EXIT_FAILURE) {
+        free_archive_block(b);
+        return EXIT_FAILURE;
+    }
+    tw->inflight[(tw->inflight_head + tw->inflight_count) % MAX_INFLIGHT_BLOCKS] = b;
+    tw->inflight_count++;
+
+    pthread_mutex_lock(&compress_pool.lock);
+    if (compress_pool.tail == NULL) {
+        compress_pool.head = b;
+    } else {
+        compress_pool.tail->next = b;
+    }
+    compress_pool.tail = b;
+    pthread_cond_signal(&compress_pool.has_blocks);
+    pthread_mutex_unlock(&compress_pool.lock);
+
+    // write whatever is already compressed, without waiting
+    while (tw->inflight_count > 0) {
+        struct archive_block *oldest = tw->inflight[tw->inflight_head];
+        pthread_mutex_lock(&tw->lock);
+        int done = oldest->done;
+        pthread_mutex_unlock(&tw->lock);
+
+        if (!done) {
+            break;
+        }
+        if (write_oldest_block(tw) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+//////////////////////////// PARALLEL COMPRESSION END ///////////////////////////////////////
+
+//////////////////////////// TAR WRITER START ///////////////////////////////////////
+
+// ustar archive written through the parallel compressor into an output descriptor,
+// replaces "tar -czf" : no shell, no child process, no temporary file
+
+const char *codec_names[] = {"none", "gzip", "zstd", "lz4", "auto"};
+
+// extensions of formats that are compressed already
+const char *compressed_extensions[] = {
+    "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar", "apk",
+    "jpg", "jpeg", "png", "gif", "webp", "heic", "mp3", "mp4", "m4a", "mkv",
+    "avi", "mov", "webm", "ogg", "flac", "pdf", "docx", "xlsx", "pptx", NULL
+};
+
+int has_compressed_extension(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL) {
+        return 0;
+    }
+    for (int i = 0; compressed_extensions[i] != NULL; i++) {
+        if (strcasecmp(ext + 1, compressed_extensions[i]) == EXIT_SUCCESS) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// leading bytes of compressed containers, images and media
+struct magic {
+    int offset;
+    int length;
+    const char *bytes;
+};
+
+const struct magic compressed_magics[] = {
+    {0, 2, "\x1f\x8b"},                 // gzip
+    {0, 3, "BZh"},                      // bzip2
+    {0, 6, "\xfd" "7zXZ\x00"},           // xz
+    {0, 4, "\x28\xb5\x2f\xfd"},         // zstd
+    {0, 4, "\x04\x22\x4d\x18"},         // lz4
+    {0, 4, "PK\x03\x04"},               // zip, jar, docx ...
+    {0, 6, "7z\xbc\xaf\x27\x1c"},         // 7z
+    {0, 4, "Rar!"},                     // rar
+    {0, 8, "\x89PNG\r\n\x1a\n"},         // png
+    {0, 3, "\xff\xd8\xff"},              // jpeg
+    {0, 4, "GIF8"},                     // gif
+    {8, 4, "WEBP"},                     // webp
+    {4, 4, "ftyp"},                     // mp4, mov, heic
+    {0, 4, "OggS"},                     // ogg
+    {0, 4, "fLaC"},                     // flac
+    {0, 3, "ID3"},                      // mp3
+    {0, 4, "%PDF"},                     // pdf
+    {0, 4, "\x1a\x45\xdf\xa3"},         // mkv, webm
+};
+
+// decide if deflating a member is wasted work : extension, magic bytes,
+// or a sample that looks random (flat byte histogram)
+int member_incompressible(int fd, const char *path, off_t size) {
+    if (size < SAMPLE_SIZE) {
+        return 0;
+    }
+    if (has_compressed_extension(path)) {
+        return 1;
+    }
+
+    unsigned char sample[SAMPLE_SIZE];
+    ssize_t n = pread(fd, sample, sizeof(sample), 0);
+    if (n < SAMPLE_SIZE) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(compressed_magics) / sizeof(compressed_magics[0]); i++) {
+        const struct magic *m = &compressed_magics[i];
+        if (memcmp(sample + m->offset, m->bytes, m->length) == EXIT_SUCCESS) {
+            return 1;
+        }
+    }
+
+    int histogram[256] = {0};
+    for (int i = 0; i < SAMPLE_SIZE; i++) {
+        histogram[sample[i]]++;
+    }
+
+    // sum((count - expected)^2 / expected), expected = SAMPLE_SIZE / 256
+    long expected = SAMPLE_SIZE / 256;
+    long chi_square = 0;
+    for (int i = 0; i < 256; i++) {
+        chi_square += (histogram[i] - expected) * (histogram[i] - expected);
+    }
+    return chi_square / expected < SAMPLE_CHI_SQUARE_LIMIT;
+}
+
+// append TAR bytes to the current block, full blocks go to the compression threads
+int tar_write(struct tar_writer *tw, const void *data, size_t length) {
+    const unsigned char *p = data;
+
+    while (length > 0) {
+        if (tw->block == NULL) {
+            tw->block = malloc(ARCHIVE_BLOCK_SIZE);
+            if (tw->block == NULL) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        size_t n = ARCHIVE_BLOCK_SIZE - tw->block_len < length ? ARCHIVE_BLOCK_SIZE - tw->block_len : length;
+        memcpy(tw->block + tw->block_len, p, n);
+        tw->block_len += n;
+        p += n;
+        length -= n;
+
+        if (tw->block_len == ARCHIVE_BLOCK_SIZE && submit_archive_block(tw, 0) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int tar_open(struct tar_writer *tw, int out_fd, int codec, int level) {
+    memset(tw, 0, sizeof(struct tar_writer));
+    tw->out_fd = out_fd;
+    tw->codec = codec;
+    tw->level = level;
+    tw->crc = crc32(0L, Z_NULL, 0);
+    pthread_mutex_init(&tw->lock, NULL);
+    pthread_cond_init(&tw->block_done, NULL);
+
+    if (codec != CODEC_GZIP) {
+        return EXIT_SUCCESS;
+    }
+
+    // gzip member header : deflate, no name, no mtime, unix
+    static const unsigned char gzip_header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    if (write_all(out_fd, gzip_header, sizeof(gzip_header)) == EXIT_FAILURE) {
+        perror("error: writing archive");
+        return EXIT_FAILURE;
+    }
+    tw->written = sizeof(gzip_header);
+    return EXIT_SUCCESS;
+}
+
+// wait for the compression threads and release the writer (also on errors)
+void tar_free(struct tar_writer *tw) {
+    while (tw->inflight_count > 0) {
+        write_oldest_block(tw);
+    }
+    free(tw->block);
+    pthread_mutex_destroy(&tw->lock);
+    pthread_cond_destroy(&tw->block_done);
+}
+
+// octal number field, NUL terminated like GNU tar writes them
+// values that do not fit are clamped (large sizes use a pax header instead)
+void tar_octal(char *field, int size, unsigned long value) {
+    unsigned long max = (1UL << (3 * (size - 1))) - 1;
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%0*lo", size - 1, value > max ? max : value);
+    memcpy(field, digits, size);
+}
+
+// fill in the checksum of a 512 byte header and write it
+int tar_write_header(struct tar_writer *tw, char *header) {
+    memset(header + 148, ' ', 8);
+
+    unsigned long checksum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += (unsigned char) header[i];
+    }
+    snprintf(header + 148, 8, "%06lo", checksum);
+    header[155] = ' ';
+
+    return tar_write(tw, header, TAR_BLOCK_SIZE);
+}
+
+void tar_fill_header(char *header, const char *name, const struct stat *st, long size, char type) {
+    memset(header, 0, TAR_BLOCK_SIZE);
+    snprintf(header, 100, "%s", name);
+    tar_octal(header + 100, 8, st->st_mode & 07777);
+    tar_octal(header + 108, 8, st->st_uid);
+    tar_octal(header + 116, 8, st->st_gid);
+    tar_octal(header + 124, 12, size);
+    tar_octal(header + 136, 12, st->st_mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+}
+
+// pad the last data block of an entry with zeros
+int tar_pad(struct tar_writer *tw, long size) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    long padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    return padding > 0 ? tar_write(tw, zeros, padding) : EXIT_SUCCESS;
+}
+
+// append one pax record "<length> <key>=<value>\n", the length counts itself
+int pax_record(char *buffer, size_t size, const char *key, const char *value) {
+    int content = strlen(key) + strlen(value) + 3;
+    int length = content + 1;
+    while (length != content + snprintf(NULL, 0, "%d", length)) {
+        length = content + snprintf(NULL, 0, "%d", length);
+    }
+    return snprintf(buffer, size, "%d %s=%s\n", length, key, value);
+}
+
+// add one regular file, stored like tar does : path without the leading '/'
+int tar_add_file(struct tar_writer *tw, const char *path) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "warning: skipping %s : %s\n", path, strerror(errno));
+        return EXIT_SUCCESS;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "warning: skipping %s : not a regular file\n", path);
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+
+    const char *name = path;
+    while (*name == '/') {
+        name++;
+    }
+
+    char header[TAR_BLOCK_SIZE];
+    long size = st.st_size;
+
+    // compressible and incompressible members do not share a block
+    int stored = tw->codec != CODEC_NONE && member_incompressible(fd, path, size);
+    if (stored != tw->stored) {
+        if (tw->block_len > 0 && submit_archive_block(tw, 0) == EXIT_FAILURE) {
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        tw->stored = stored;
+    }
+    if (stored) {
+        tw->stored_files++;
+        tw->stored_bytes += size;
+    }
+
+    // names over 100 bytes and sizes over 8 GB go into a pax extended header
+    if (strlen(name) >= 100 || size > 077777777777L) {
+        char records[2 * MAX_PATH_LENGTH];
+        char size_str[32];
+        snprintf(size_str, sizeof(size_str), "%ld", size);
+
+        int length = pax_record(records, sizeof(records), "path", name);
+        length += pax_record(records + length, sizeof(records) - length, "size", size_str);
+
+        tar_fill_header(header, "././@PaxHeader", &st, length, 'x');
+        if (tar_write_header(tw, header) == EXIT_FAILURE ||
+            tar_write(tw, records, length) == EXIT_FAILURE ||
+            tar_pad(tw, length) == EXIT_FAILURE) {
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    tar_fill_header(header, name, &st, size > 077777777777L ? 0 : size, '0');
+    if (tar_write_header(tw, header) == EXIT_FAILURE) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    // stream the body, a file changing meanwhile is cut / zero padded to the header size
+    char buffer[TAR_READ_CHUNK];
+    long remaining = size;
+    while (remaining > 0) {
+        ssize_t n = read(fd, buffer, remaining < (long) sizeof(buffer) ? remaining : (long) sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "warning: %s shrank while reading, padding with zeros\n", path);
+            memset(buffer, 0, sizeof(buffer));
+            n = remaining < (long) sizeof(buffer) ? remaining : (long) sizeof(buffer);
+        }
+        if (tar_write(tw, buffer, n) == EXIT_FAILURE) {
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        remaining -= n;
+    }
+    close(fd);
+
+    return tar_pad(tw, size);
+}
+
+// end of archive marker (two zero blocks), the last block and the gzip trailer
+int tar_close(struct tar_writer *tw) {
+    static const char zeros[2 * TAR_BLOCK_SIZE];
+    if (tar_write(tw, zeros, sizeof(zeros)) == EXIT_FAILURE || submit_archive_block(tw, 1) == EXIT_FAILURE) {
+        tar_free(tw);
+        return EXIT_FAILURE;
+    }
+
+    while (tw->inflight_count > 0) {
+        if (write_oldest_block(tw) == EXIT_FAILURE) {
+            tar_free(tw);
+            return EXIT_FAILURE;
+        }
+    }
+    tar_free(tw);
+
+    if (tw->codec != CODEC_GZIP) {
+        return EXIT_SUCCESS;
+    }
+
+    // gzip trailer : CRC-32 and length of the uncompressed data, little endian
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (tw->crc >> (8 * i)) & 0xff;
+        trailer[4 + i] = (tw->total_in >> (8 * i)) & 0xff;
+    }
+    if (write_all(tw->out_fd, trailer, sizeof(trailer)) == EXIT_FAILURE) {
+        perror("error: writing archive");
+        return EXIT_FAILURE;
+    }
+    tw->written += sizeof(trailer);
+    report_archive_progress(tw->written);
+    return EXIT_SUCCESS;
+}
+
+//////////////////////////// TAR WRITER END ///////////////////////////////////////
+
+// write the archive into archive_fd, compressed with the job's codec
+// with the files from -> entries (result_path())
+// number of files -> file_count
+int create_archive(int archive_fd) {
+    //TODO remove DEBUG
+    if (current_job->file_count > 0) {
+        printf("file(s) found : %d\n", current_job->file_count);
+    } else {
+        printf("No file found\n");
+    }
+
+    struct tar_writer *tw = malloc(sizeof(struct tar_writer));
+    if (tw == NULL || tar_open(tw, archive_fd, current_job->codec, current_job->level) == EXIT_FAILURE) {
+        free(tw);
+        fprintf(stderr, "error: failed to create the archive\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < current_job->file_count; i++) {
+        if (tar_add_file(tw, result_path(current_job, i)) == EXIT_FAILURE) {
+            tar_free(tw);
+            free(tw);
+            fprintf(stderr, "error: failed to create the archive\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (tar_close(tw) == EXIT_FAILURE) {
+        free(tw);
+        fprintf(stderr, "error: failed to create the archive\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("tar file created : %ld bytes\n", (long) tw->written);
+    if (tw->stored_files > 0) {
+        printf("stored without compression : %d file(s), %ld bytes\n", tw->stored_files, (long) tw->stored_bytes);
+    }
+    free(tw);
+    return EXIT_SUCCESS;
+}
+
+//////////////////////////// ARCHIVE STAGING START ///////////////////////////////////////
+
+// every archive gets its own unnamed file, concurrent requests never share one;
+// the worst case size is reserved up front to pick memory or disk
+struct staging_budget {
+    pthread_mutex_t lock;
+    off_t memory_limit;
+    off_t memory_used;
+    off_t disk_limit; // 0 : unlimited
+    off_t disk_used;
+    const char *spill_dir;
+};
+
+struct staging_budget staging = {PTHREAD_MUTEX_INITIALIZER, DEFAULT_MEMORY_BUDGET_MB * 1024L * 1024L, 0, 0, 0, DEFAULT_SPILL_DIR};
+
+// upper bound of the archive : members stored as they are, tar / pax headers and codec framing
+off_t archive_size_bound(struct archive_job *job) {
+    off_t bound = 2 * TAR_BLOCK_SIZE;
+    for (int i = 0; i < job->file_count; i++) {
+        struct stat st;
+        if (stat(result_path(job, i), &st) == 0) {
+            bound += st.st_size + 4 * TAR_BLOCK_SIZE;
+        }
+    }
+    // block / frame overhead stays well below 1 %
+    return bound + bound / 100 + 64 * 1024;
+}
+
+// unnamed file in the spill directory, mkstemp() + unlink() where O_TMPFILE is missing
+int open_spill_file() {
+    int fd = open(staging.spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+        return fd;
+    }
+
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/w24-archive-XXXXXX", staging.spill_dir);
+    if ((fd = mkstemp(path)) >= 0) {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+void release_staging(off_t bytes, int on_disk) {
+    if (bytes == 0) {
+        return;
+    }
+    pthread_mutex_lock(&staging.lock);
+    if (on_disk) {
+        staging.disk_used -= bytes;
+    } else {
+        staging.memory_used -= bytes;
+    }
+    pthread_mutex_unlock(&staging.lock);
+}
+
+// charge bytes to one budget, EXIT_FAILURE when it has no room
+int reserve_staging(off_t bytes, int on_disk) {
+    int status = EXIT_SUCCESS;
+    pthread_mutex_lock(&staging.lock);
+    if (on_disk && (staging.disk_limit == 0 || staging.disk_used + bytes <= staging.disk_limit)) {
+        staging.disk_used += bytes;
+    } else if (!on_disk && staging.memory_used + bytes <= staging.memory_limit) {
+        staging.memory_used += bytes;
+    } else {
+        status = EXIT_FAILURE;
+    }
+    pthread_mutex_unlock(&staging.lock);
+    return status;
+}
+
+int cache_shrink();
+
+// reserve the budget for the job's archive and open the file it is written to,
+// cached archives are dropped for room; returns -1 with errno EBUSY when neither budget has room
+int open_staging(struct archive_job *job) {
+    off_t bound = archive_size_bound(job);
+
+    for (;;) {
+        if (reserve_staging(bound, 0) == EXIT_SUCCESS) {
+            job->staged_on_disk = 0;
+            break;
+        }
+        if (reserve_staging(bound, 1) == EXIT_SUCCESS) {
+            job->staged_on_disk = 1;
+            break;
+        }
+        if (cache_shrink() == EXIT_FAILURE) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    job->staged_bytes = bound;
+
+    int fd;
+    if (job->staged_on_disk) {
+        printf("staging archive in %s (%ld bytes reserved)\n", staging.spill_dir, (long) bound);
+        fd = open_spill_file();
+    } else {
+        fd = memfd_create("w24-archive", MFD_CLOEXEC);
+    }
+
+    if (fd < 0) {
+        int saved = errno;
+        release_staging(job->staged_bytes, job->staged_on_disk);
+        job->staged_bytes = 0;
+        errno = saved;
+    }
+    return fd;
+}
+
+//////////////////////////// ARCHIVE STAGING END ///////////////////////////////////////
+
+//////////////////////////// ARCHIVE CACHE START ///////////////////////////////////////
+
+// finished archives keyed by the sorted path list, each file's size / mtime / inode
+// and the codec; a hit is sent from a dup of the cached file, nothing is rebuilt
+struct cache_entry {
+    uint64_t key[2];
+    int fd;
+    off_t size;
+    int on_disk; // budget its size is reserved in
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev; // towards the most recently used
+    struct cache_entry *lru_next;
+};
+
+struct archive_cache {
+    pthread_mutex_t lock;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *lru_head; // most recently used
+    struct cache_entry *lru_tail;
+    off_t limit;
+    off_t used;
+    int entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+struct archive_cache cache = {PTHREAD_MUTEX_INITIALIZER, {NULL}, NULL, NULL, DEFAULT_CACHE_BUDGET_MB * 1024L * 1024L, 0, 0, 0, 0, 0};
+
+// FNV-1a, the two halves of the key use different offset bases
+void fingerprint_bytes(uint64_t key[2], const void *data, size_t length) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < length; i++) {
+        key[0] = (key[0] ^ p[i]) * 0x100000001b3ULL;
+        key[1] = (key[1] ^ p[i]) * 0x100000001b3ULL;
+    }
+}
+
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+// fingerprint of the job's file set, returns EXIT_FAILURE if a file can not be stat'ed
+int archive_fingerprint(struct archive_job *job, uint64_t key[2]) {
+    int count = job->file_count;
+    const char **paths = malloc((count + 1) * sizeof(char *));
+    if (paths == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+        paths[i] = result_path(job, i);
+    }
+    qsort(paths, count, sizeof(paths[0]), compare_paths);
+
+    key[0] = 0xcbf29ce484222325ULL;
+    key[1] = 0x84222325cbf29ce4ULL;
+    fingerprint_bytes(key, &job->codec, sizeof(job->codec));
+    fingerprint_bytes(key, &job->level, sizeof(job->level));
+
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) < 0) {
+            free(paths);
+            return EXIT_FAILURE;
+        }
+        // path with its terminating NUL, then the metadata
+        fingerprint_bytes(key, paths[i], strlen(paths[i]) + 1);
+        fingerprint_bytes(key, &st.st_size, sizeof(st.st_size));
+        fingerprint_bytes(key, &st.st_mtim, sizeof(st.st_mtim));
+        fingerprint_bytes(key, &st.st_ino, sizeof(st.st_ino));
+        fingerprint_bytes(key, &st.st_dev, sizeof(st.st_dev));
+    }
+    free(paths);
+    return EXIT_SUCCESS;
+}
+
+void cache_unlink_lru(struct cache_entry *e) {
+    if (e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        cache.lru_head = e->lru_next;
+    }
+    if (e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        cache.lru_tail = e->lru_prev;
+    }
+}
+
+void cache_push_lru(struct cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache.lru_head;
+    if (cache.lru_head != NULL) {
+        cache.lru_head->lru_prev = e;
+    }
+    cache.lru_head = e;
+    if (cache.lru_tail == NULL) {
+        cache.lru_tail = e;
+    }
+}
+
+// drop the least recently used entry, sessions sending it keep their own dup
+void cache_evict() {
+    struct cache_entry *e = cache.lru_tail;
+    cache_unlink_lru(e);
+
+    struct cache_entry **link = &cache.buckets[e->key[0] % CACHE_BUCKETS];
+    while (*link != e) {
+        link = &(*link)->hash_next;
+    }
+    *link = e->hash_next;
+
+    cache.used -= e->size;
+    cache.entries--;
+    cache.evictions++;
+    release_staging(e->size, e->on_disk);
+    close(e->fd);
+    free(e);
+}
+
+// give the budget of the least recently used entry back, EXIT_FAILURE when the cache is empty
+int cache_shrink() {
+    int status = EXIT_FAILURE;
+    pthread_mutex_lock(&cache.lock);
+    if (cache.entries > 0) {
+        cache_evict();
+        status = EXIT_SUCCESS;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return status;
+}
+
+// returns a new descriptor of the cached archive and its size, -1 on a miss
+int cache_lookup(const uint64_t key[2], off_t *size) {
+    int fd = -1;
+
+    pthread_mutex_lock(&cache.lock);
+    struct cache_entry *e = cache.buckets[key[0] % CACHE_BUCKETS];
+    while (e != NULL && (e->key[0] != key[0] || e->key[1] != key[1])) {
+        e = e->hash_next;
+    }
+
+    if (e != NULL && (fd = dup(e->fd)) >= 0) {
+        cache_unlink_lru(e);
+        cache_push_lru(e);
+        *size = e->size;
+        cache.hits++;
+    } else {
+        cache.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    return fd;
+}
+
+// keep a copy of a finished archive, older entries make room
+// the entry takes over size bytes of the job's -m / -d reservation, released on eviction
+void cache_insert(const uint64_t key[2], struct archive_job *job) {
+    struct stat st;
+    if (cache.limit == 0 || fstat(job->archive_fd, &st) < 0 || st.st_size > cache.limit
+            || st.st_size > job->staged_bytes) {
+        return;
+    }
+
+    struct cache_entry *e = calloc(1, sizeof(struct cache_entry));
+    if (e == NULL || (e->fd = dup(job->archive_fd)) < 0) {
+        free(e);
+        return;
+    }
+    e->key[0] = key[0];
+    e->key[1] = key[1];
+    e->size = st.st_size;
+    e->on_disk = job->staged_on_disk;
+
+    pthread_mutex_lock(&cache.lock);
+    // another job may have built the same archive meanwhile
+    struct cache_entry *existing = cache.buckets[key[0] % CACHE_BUCKETS];
+    while (existing != NULL && (existing->key[0] != key[0] || existing->key[1] != key[1])) {
+        existing = existing->hash_next;
+    }
+    if (existing != NULL) {
+        pthread_mutex_unlock(&cache.lock);
+        close(e->fd);
+        free(e);
+        return;
+    }
+
+    while (cache.used + e->size > cache.limit) {
+        cache_evict();
+    }
+
+    struct cache_entry **bucket = &cache.buckets[key[0] % CACHE_BUCKETS];
+    e->hash_next = *bucket;
+    *bucket = e;
+    cache_push_lru(e);
+    cache.used += e->size;
+    cache.entries++;
+    job->staged_bytes -= e->size;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// text for w24stats
+void cache_stats(char *buffer, size_t size) {
+    pthread_mutex_lock(&cache.lock);
+    unsigned long lookups = cache.hits + cache.misses;
+    snprintf(buffer, size,
+             "archive cache (worker %d): %d entries, %ld / %ld bytes\n"
+             "hits: %lu, misses: %lu, hit rate: %.1f%%, evictions: %lu\n",
+             worker_id, cache.entries, (long) cache.used, (long) cache.limit,
+             cache.hits, cache.misses, lookups > 0 ? 100.0 * cache.hits / lookups : 0.0, cache.evictions);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+//////////////////////////// ARCHIVE CACHE END ///////////////////////////////////////
+
+//////////////////////////// THREAD POOL START ///////////////////////////////////////
+
+// pool threads run traversal + compression, the event loop only hands jobs over
+// and sends the results
+struct job_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs;
+    struct archive_job *queue_head; // waiting for a pool thread
+    struct archive_job *queue_tail;
+    struct archive_job *done;       // finished, waiting for the event loop
+    struct archive_job *progress;   // streamed archives with new bytes
+    int queued;
+    int event_fd;                   // wakes the event loop when jobs finish
+};
+
+struct job_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, NULL, 0, -1};
+
+int codec_supported(int codec) {
+    (void) codec; // unused when every codec is built in
+#ifndef WITH_ZSTD
+    if (codec == CODEC_ZSTD) {
+        return 0;
+    }
+#endif
+#ifndef WITH_LZ4
+    if (codec == CODEC_LZ4) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+int default_codec_level(int codec) {
+    if (codec == CODEC_GZIP) {
+        return 6;
+    }
+    if (codec == CODEC_ZSTD) {
+        return 3;
+    }
+    return 0;
+}
+
+// find and remove "-c <codec>[:<level>]" from the arguments of an archive command
+// returns 0 when absent, 1 when parsed, -1 when the codec or level is invalid
+int parse_codec_option(char *args, int *codec, int *level) {
+    char *option = NULL;
+    for (char *p = args; (p = strstr(p, "-c")) != NULL; p += 2) {
+        if ((p == args || p[-1] == ' ') && (p[2] == ' ')) {
+            option = p;
+            break;
+        }
+    }
+    if (option == NULL) {
+        return 0;
+    }
+
+    char *value = option + 3;
+    while (*value == ' ') {
+        value++;
+    }
+    size_t value_len = strcspn(value, " \n");
+    char *end = value + value_len;
+
+    char name[16];
+    if (value_len == 0 || value_len >= sizeof(name)) {
+        return -1;
+    }
+    memcpy(name, value, value_len);
+    name[value_len] = '\0';
+
+    char *level_str = strchr(name, ':');
+    if (level_str != NULL) {
+        *level_str++ = '\0';
+    }
+
+    *codec = -1;
+    for (int i = CODEC_NONE; i <= CODEC_AUTO; i++) {
+        if (strcmp(name, codec_names[i]) == EXIT_SUCCESS) {
+            *codec = i;
+        }
+    }
+    if (*codec < 0) {
+        return -1;
+    }
+
+    *level = default_codec_level(*codec);
+    if (level_str != NULL) {
+        char *level_end;
+        long value_level = strtol(level_str, &level_end, 10);
+        int max_level = *codec == CODEC_GZIP ? 9 : *codec == CODEC_ZSTD ? 19 : *codec == CODEC_LZ4 ? 12 : -1;
+        if (*level_str == '\0' || *level_end != '\0' || value_level < 0 || value_level > max_level) {
+            return -1;
+        }
+        *level = value_level;
+    }
+
+    // the remaining arguments are parsed as before
+    while (*end == ' ') {
+        end++;
+    }
+    memmove(option, end, strlen(end) + 1);
+    size_t len = strlen(args);
+    while (len > 0 && args[len - 1] == ' ') {
+        args[--len] = '\0';
+    }
+    return 1;
+}
+
+// "<flag> <count>" of a command, like "-n <count>" of the archive commands (archive the first
+// count matches only) or "-p <count>" of the listings. Removed from args like -c; returns 1
+// when given, 0 when not, -1 when the count is not valid
+int parse_count_option(char *args, const char *flag, long *limit) {
+    size_t flag_length = strlen(flag);
+    char *option = NULL;
+    for (char *p = args; (p = strstr(p, flag)) != NULL; p += flag_length) {
+        if ((p == args || p[-1] == ' ') && (p[flag_length] == ' ')) {
+            option = p;
+            break;
+        }
+    }
+    if (option == NULL) {
+        return 0;
+    }
+
+    char *value = option + flag_length + 1;
+    while (*value == ' ') {
+        value++;
+    }
+    char *end;
+    long count = strtol(value, &end, 10);
+    if (end == value || count < 1 || count > INT32_MAX || (*end != ' ' && *end != '\n' && *end != '\0')) {
+        return -1;
+    }
+    *limit = count;
+
+    while (*end == ' ') {
+        end++;
+    }
+    memmove(option, end, strlen(end) + 1);
+    size_t len = strlen(args);
+    while (len > 0 && args[len - 1] == ' ') {
+        args[--len] = '\0';
+    }
+    return 1;
+}
+
+// auto : store when most of the bytes are compressed already, otherwise the fastest codec built in
+void resolve_auto_codec(struct archive_job *job) {
+    off_t total = 0;
+    off_t compressed = 0;
+
+    for (int i = 0; i < job->file_count; i++) {
+        struct stat st;
+        if (stat(result_path(job, i), &st) < 0) {
+            continue;
+        }
+        total += st.st_size;
+        if (has_compressed_extension(result_path(job, i))) {
+            compressed += st.st_size;
+        }
+    }
+
+    if (total > 0 && compressed * 10 >= total * 9) {
+        job->codec = CODEC_NONE;
+    } else if (codec_supported(CODEC_ZSTD)) {
+        job->codec = CODEC_ZSTD;
+    } else if (codec_supported(CODEC_LZ4)) {
+        job->codec = CODEC_LZ4;
+    } else {
+        job->codec = CODEC_GZIP;
+        job->level = 1;
+        return;
+    }
+    job->level = default_codec_level(job->codec);
+}
+
+void update_session(struct session *s);
+void close_session(struct session *s);
+void send_archive_error(struct session *s, const char *text);
+
+struct archive_job *create_job(int type, const char *args) {
+    static unsigned long next_job_id = 0;
+
+    struct archive_job *job = calloc(1, sizeof(struct archive_job));
+    if (job == NULL) {
+        perror("error: allocating job\n");
+        return NULL;
+    }
+
+    job->type = type;
+    job->id = ++next_job_id;
+    job->archive_fd = -1;
+    job->codec = CODEC_GZIP;
+    job->level = default_codec_level(CODEC_GZIP);
+    snprintf(job->args, sizeof(job->args), "%s", args);
+    return job;
+}
+
+void free_job(struct archive_job *job) {
+    if (job->archive_fd >= 0) {
+        close(job->archive_fd);
+    }
+    release_staging(job->staged_bytes, job->staged_on_disk);
+    if (job->image != NULL) {
+        image_release(job->image);
+    }
+    free(job->entries);
+    free_listing(job->listing);
+    free(job->text);
+    free(job);
+}
+
+// build the file list and the TAR file of a job, runs on a pool thread
+void run_job(struct archive_job *job) {
+    current_job = job;
+
+    if (job->type == JOB_SEARCH) {
+        search_file(job);
+        return;
+    }
+    if (job->type == JOB_NEXT) {
+        search_page(job);
+        return;
+    }
+
+    int status;
+    if (job->type == JOB_SIZE) {
+        status = create_file_list(job->size1, job->size2);
+    } else if (job->type == JOB_TYPES) {
+        status = create_file_list_on_file_types(job->args);
+    } else if (job->type == JOB_QUERY) {
+        status = create_file_list_on_query(job->args);
+    } else {
+        status = create_file_list_on_date(job->args, job->type == JOB_BEFORE ? 1 : 2);
+    }
+
+    if (status == EXIT_FAILURE) {
+        if (job->text == NULL) {
+            job->text = strdup("No file found\n");
+        }
+        return;
+    }
+
+    if (job->codec == CODEC_AUTO) {
+        resolve_auto_codec(job);
+        printf("auto codec : %s:%d\n", codec_names[job->codec], job->level);
+    }
+
+    // same files, unchanged, same codec : send the archive built last time
+    uint64_t key[2];
+    int cacheable = cache.limit > 0 && archive_fingerprint(job, key) == EXIT_SUCCESS;
+    off_t cached_size;
+    if (cacheable && (job->archive_fd = cache_lookup(key, &cached_size)) >= 0) {
+        printf("archive cache hit : %ld bytes\n", (long) cached_size);
+        job->produced = cached_size;
+        return;
+    }
+
+    // every job writes its own unnamed file, in memory or spilled to disk
+    job->archive_fd = open_staging(job);
+    if (job->archive_fd < 0 && errno == EBUSY) {
+        job->text = strdup("error: server busy, try again later\n");
+        return;
+    }
+    if (job->archive_fd < 0) {
+        perror("error: staging archive");
+        job->text = strdup("error: failed to create the archive\n");
+        return;
+    }
+
+    if (create_archive(job->archive_fd) == EXIT_FAILURE) {
+        close(job->archive_fd);
+        job->archive_fd = -1;
+        job->text = strdup("error: failed to create the archive\n");
+    } else if (cacheable) {
+        cache_insert(key, job);
+    }
+}
+
+// publish the bytes written so far, the event loop is woken up every STREAM_SIGNAL_BYTES
+void report_archive_progress(off_t written) {
+    struct archive_job *job = current_job;
+    if (job == NULL || !job->framed) {
+        return;
+    }
+
+    __atomic_store_n(&job->produced, written, __ATOMIC_RELEASE);
+    if (job->signaled > 0 && written - job->signaled < STREAM_SIGNAL_BYTES) {
+        return;
+    }
+    job->signaled = written;
+
+    pthread_mutex_lock(&pool.lock);
+    if (!job->progress_queued) {
+        job->progress_queued = 1;
+        job->progress_next = pool.progress;
+        pool.progress = job;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    uint64_t one = 1;
+    if (write(pool.event_fd, &one, sizeof(one)) < 0) {
+        perror("error: signaling archive progress");
+    }
+}
+
+void *pool_thread(void *arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.queue_head == NULL) {
+            pthread_cond_wait(&pool.has_jobs, &pool.lock);
+        }
+        struct archive_job *job = pool.queue_head;
+        pool.queue_head = job->next;
+        if (pool.queue_head == NULL) {
+            pool.queue_tail = NULL;
+        }
+        pool.queued--;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&pool.lock);
+        job->next = pool.done;
+        pool.done = job;
+        pthread_mutex_unlock(&pool.lock);
+
+        uint64_t one = 1;
+        if (write(pool.event_fd, &one, sizeof(one)) < 0) {
+            perror("error: signaling finished job");
+        }
+    }
+    return NULL;
+}
+
+int start_job_pool(int threads) {
+    if ((pool.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("error: eventfd");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+            perror("error: starting pool thread");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    return EXIT_SUCCESS;
+}
+
+// hand a job to the pool, the session waits until finish_job()
+void submit_job(struct session *s, struct archive_job *job) {
+    if (job == NULL) {
+        send_response(s, "error: server out of memory\n");
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.queued >= MAX_QUEUED_JOBS) {
+        pthread_mutex_unlock(&pool.lock);
+        if (job->framed) {
+            send_archive_error(s, "error: server busy, try again later\n");
+        } else {
+            send_response(s, "error: server busy, try again later\n");
+        }
+        free_job(job);
+        return;
+    }
+
+    job->session = s;
+    job->next = NULL;
+    if (pool.queue_tail == NULL) {
+        pool.queue_head = job;
+    } else {
+        pool.queue_tail->next = job;
+    }
+    pool.queue_tail = job;
+    pool.queued++;
+    pthread_cond_signal(&pool.has_jobs);
+    pthread_mutex_unlock(&pool.lock);
+
+    s->job = job;
+    s->state = SESSION_WORKING;
+}
+
+// framed error : W24E header with the length of the text, then the text
+void send_archive_error(struct session *s, const char *text) {
+    struct archive_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_ERROR_MAGIC, sizeof(header.magic));
+    header.size = strlen(text);
+
+    printf("preparing archive error : %s\n", text);
+    if (queue_output(s, &header, sizeof(header)) == EXIT_FAILURE || queue_output(s, text, header.size) == EXIT_FAILURE) {
+        perror("error: sending archive error\n");
+    }
+}
+
+// start sending a framed archive while its job still writes it
+int start_stream(struct session *s, struct archive_job *job) {
+    int tar_fd = dup(job->archive_fd);
+    if (tar_fd < 0) {
+        perror("error: dup archive");
+        return EXIT_FAILURE;
+    }
+
+    struct archive_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.codec = job->codec;
+    header.level = job->level;
+    header.size = ARCHIVE_STREAMED;
+
+    if (queue_output(s, &header, sizeof(header)) == EXIT_FAILURE) {
+        close(tar_fd);
+        return EXIT_FAILURE;
+    }
+
+    s->tar_fd = tar_fd;
+    s->tar_size = 0;
+    s->tar_offset = 0;
+    s->tar_copy = 0;
+    s->streaming = 1;
+
+    // the job keeps its budget while it runs, cache_insert() may take a part of it
+    s->state = SESSION_SENDING;
+    printf("streaming %s archive\n", codec_names[job->codec]);
+    return EXIT_SUCCESS;
+}
+
+// queue the header of the next chunk of a streamed archive
+// returns 0 when the job has not written anything new yet
+int next_stream_chunk(struct session *s) {
+    struct archive_job *job = s->job;
+    off_t produced = __atomic_load_n(&job->produced, __ATOMIC_ACQUIRE);
+    uint32_t length;
+
+    if (produced > s->tar_offset) {
+        length = produced - s->tar_offset < SENDFILE_CHUNK ? produced - s->tar_offset : SENDFILE_CHUNK;
+        s->tar_size = s->tar_offset + length;
+    } else if (job->completed) {
+        // zero length chunk ends the archive
+        length = 0;
+        s->streaming = 0;
+        s->job = NULL;
+        // the budget is returned once the session closes its copy
+        s->staged_bytes = job->staged_bytes;
+        s->staged_on_disk = job->staged_on_disk;
+        job->staged_bytes = 0;
+        free_job(job);
+    } else {
+        return 0;
+    }
+
+    if (queue_output(s, &length, sizeof(length)) == EXIT_FAILURE) {
+        return -1;
+    }
+    return 1;
+}
+
+// a streamed job wrote more, runs on the event loop
+void job_progress(struct archive_job *job) {
+    struct session *s = job->session;
+    if (s == NULL) {
+        return;
+    }
+
+    if (s->state == SESSION_WORKING) {
+        if (start_stream(s, job) == EXIT_FAILURE) {
+            close_session(s);
+            return;
+        }
+        update_session(s);
+    } else if (s->stream_waiting) {
+        update_session(s);
+    }
+}
+
+// send the result of a finished job to its session, runs on the event loop
+void finish_job(struct archive_job *job) {
+    struct session *s = job->session;
+
+    if (s == NULL) {
+        // client disconnected while the job was running
+        free_job(job);
+        return;
+    }
+
+    if (job->framed && job->text == NULL && !s->streaming && start_stream(s, job) == EXIT_FAILURE) {
+        job->text = strdup("error: failed to send the archive\n");
+    }
+
+    if (s->streaming) {
+        if (job->text != NULL) {
+            // the archive broke off after the header went out, the client can only notice the drop
+            fprintf(stderr, "error: archive stream aborted : %s", job->text);
+            s->job = NULL;
+            free_job(job);
+            close_session(s);
+            return;
+        }
+
+        // next_stream_chunk() sends the end of the archive and frees the job
+        job->completed = 1;
+        update_session(s);
+        return;
+    }
+
+    s->job = NULL;
+    s->state = SESSION_COMMAND;
+
+    if (job->listing != NULL) {
+        // pages left, continued by w24next
+        free_listing(s->listing);
+        s->listing = job->listing;
+        job->listing = NULL;
+    }
+
+    if (job->text != NULL && job->framed) {
+        send_archive_error(s, job->text);
+    } else if (job->text != NULL) {
+        send_response(s, job->text);
+    } else {
+        // the session takes over the archive and closes it once sent
+        int archive_fd = job->archive_fd;
+        job->archive_fd = -1;
+
+        if (send_tar_file(s, archive_fd) == EXIT_FAILURE) {
+            printf("error : tar file send operation failed\n");
+        } else {
+            s->staged_bytes = job->staged_bytes;
+            s->staged_on_disk = job->staged_on_disk;
+            job->staged_bytes = 0;
+            printf("tar file send operation successful\n");
+        }
+    }
+
+    free_job(job);
+    update_session(s);
+}
+
+//////////////////////////// THREAD POOL END ///////////////////////////////////////
+
+// handle one command received from a client session
+// archive commands accept "-c <codec>[:<level>]", the reply then uses the framed stream
+// returns NULL after answering the client itself
+struct archive_job *create_archive_job(struct session *s, int type, char *args) {
+    int codec, level;
+    int option = parse_codec_option(args, &codec, &level);
+    if (option < 0) {
+        send_archive_error(s, "error: invalid codec, use -c none|gzip|zstd|lz4|auto[:level]\n");
+        return NULL;
+    }
+    if (option == 1 && !codec_supported(codec)) {
+        char response[100];
+        sprintf(response, "error: codec %s is not supported by this server\n", codec_names[codec]);
+        send_archive_error(s, response);
+        return NULL;
+    }
+
+    long limit = 0;
+    if (parse_count_option(args, "-n", &limit) < 0) {
+        if (option == 1) {
+            send_archive_error(s, "error: invalid file count, use -n <count>\n");
+        } else {
+            send_response(s, "error: invalid file count, use -n <count>\n");
+        }
+        return NULL;
+    }
+
+    struct archive_job *job = create_job(type, args);
+    if (job == NULL) {
+        if (option == 1) {
+            send_archive_error(s, "error: server out of memory\n");
+        } else {
+            send_response(s, "error: server out of memory\n");
+        }
+        return NULL;
+    }
+
+    if (option == 1) {
+        job->framed = 1;
+        job->codec = codec;
+        job->level = level;
+    }
+    job->limit = limit;
+    return job;
+}
+
+// cmd 10 : next page of the session's listing, cursor NULL for the first page
+void send_next_page(struct session *s, char *cursor) {
+    struct listing *listing = s->listing;
+    if (cursor != NULL) {
+        cursor[strcspn(cursor, " \r\n")] = '\0';
+        char expected[64];
+        if (listing != NULL) {
+            listing_cursor(listing, expected, sizeof(expected));
+        }
+        if (listing == NULL || strcmp(cursor, expected) != 0) {
+            send_response(s, "error: unknown or expired cursor\n");
+            return;
+        }
+    }
+
+    if (listing->type == LISTING_SEARCH) {
+        // the search runs on the thread pool, finish_job() gives the listing back
+        struct archive_job *job = create_job(JOB_NEXT, "");
+        if (job != NULL) {
+            job->listing = listing;
+            s->listing = NULL;
+        }
+        submit_job(s, job);
+        return;
+    }
+
+    struct text_buffer text = {NULL, 0, 0};
+    if (directories_page(listing, &text) == EXIT_FAILURE) {
+        send_response(s, "error: server out of memory\n");
+    } else {
+        send_response(s, text.data != NULL ? text.data : "");
+    }
+    free(text.data);
+
+    if (listing->next_name == listing->name_count) {
+        free_listing(listing);
+        s->listing = NULL;
+    }
+}
+
+// cmd 1 & 2 : first page of a dirlist, "-p <count>" lines per page
+void send_directories(struct session *s, int order, char *options) {
+    long page_size = DEFAULT_PAGE_LINES;
+    if (parse_count_option(options, "-p", &page_size) < 0) {
+        send_response(s, "error: invalid page size, use -p <count>\n");
+        return;
+    }
+
+    free_listing(s->listing);
+    s->listing = list_directories(order, page_size);
+    if (s->listing == NULL) {
+        send_response(s, "error: failed to list the home directory\n");
+        return;
+    }
+
+    send_next_page(s, NULL);
+}
+
+void crequest(struct session *s, char *buffer, int valread) {
+    if (valread == 0 || strncmp(buffer, "quitc", 5) == EXIT_SUCCESS) { // cmd 8
+        char* response = "EXIT";
+        send_response(s, response);
+
+        // close the connection once the response is written
+        s->state = SESSION_CLOSING;
+        return;
+    }
+
+    // process command and send response to client
+    // searches and archives are built on the thread pool, see run_job()
+    if (strncmp(buffer, "w24fn ", 6) == EXIT_SUCCESS) { // cmd 3
+        // w24fn TEST2_1_word_2.pdf
+
+        // w24fn TEST2 -p 100 (every match, 100 per page)
+
+        // printf("received cmd : w24fn \n");
+        // extract filename from the command
+        char *filename = buffer + 6;
+        // printf("received cmd filename : %s \n", filename);
+
+        long page_size = 0;
+        if (parse_count_option(filename, "-p", &page_size) < 0) {
+            send_response(s, "error: invalid page size, use -p <count>\n");
+            return;
+        }
+        if (page_size > 0) {
+            free_listing(s->listing);
+            s->listing = NULL;
+        }
+
+        // Search for the file starting from the home directory
+        struct archive_job *job = create_job(JOB_SEARCH, filename);
+        if (job != NULL) {
+            job->page_size = page_size;
+        }
+        submit_job(s, job);
+    } else if (strncmp(buffer, "w24fz ", 6) == EXIT_SUCCESS) { // cmd 4
+        // w24fz 1227 69879
+
+        // printf("received cmd : w24fz \n");
+        // Extract size1 and size2 from the command
+        char *sizes = buffer + 6;
+        // printf("sizes: %s\n", sizes);
+
+        struct archive_job *job = create_archive_job(s, JOB_SIZE, sizes);
+        if (job == NULL) {
+            return;
+        }
+
+        off_t size1, size2;
+        if (sscanf(sizes, "%ld %ld", &size1, &size2) != 2 || size1 < 0 || size2 < 0 || size1 > size2) {
+            if (job->framed) {
+                send_archive_error(s, "error : invalid size range\n");
+            } else {
+                send_response(s, "error : invalid size range\n");
+            }
+            free_job(job);
+            return;
+        }
 
-    // build the tar command with file paths
-    // base + file_name + space + filepaths + space + ' + '
-    int total_size = sizeof(cmd_base) + strlen(file_name) + 1 +file_count * MAX_PATH_LENGTH + file_count * 3;
-    char *command = malloc(total_size * sizeof(char));
+        job->size1 = size1;
+        job->size2 = size2;
+        submit_job(s, job);
+    } else if (strncmp(buffer, "w24ft ", 6) == EXIT_SUCCESS) { // cmd 5
+        // w24ft c txt pdf
+        // w24ft pdf
+        // w24ft c txt pdf pptx
 
-    strcpy(command, cmd_base);
-    // add file name
-    strcat(command, file_name);
-    strcat(command, " ");
+        char *extension_str = buffer + 6;
+        // printf("extentions: %s\n", extension_str); // Debug print
 
-    // snprintf(command, sizeof(command), "tar -czf temp.tar.gz ");
-    for (int i = 0; i < file_count; i++) {
-        printf("path : %s\n", file_paths[i]);
-        if(file_paths[i][0] != '\0') {
-            strcat(command, "'");
-            strcat(command, file_paths[i]);
-            strcat(command, "'");
-            strcat(command, " ");
+        struct archive_job *job = create_archive_job(s, JOB_TYPES, extension_str);
+        if (job != NULL) {
+            submit_job(s, job);
         }
-    }
+    } else if (strncmp(buffer, "w24fdb ", 6) == EXIT_SUCCESS) { // cmd 6
+        // w24fdb 2024-03-03
 
-    printf("command %s\n", command);
+        // printf("received cmd: w24fdb \n");
+        // extract date
+        char *date = buffer + 6;
+        // printf("date: %s\n", date);
 
-    // temporarily block SIGCHLD signals around system() call
-    sigset_t mask, prev_mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+        struct archive_job *job = create_archive_job(s, JOB_BEFORE, date);
+        if (job != NULL) {
+            submit_job(s, job);
+        }
+    } else if (strncmp(buffer, "w24fda ", 6) == EXIT_SUCCESS) { // cmd 7
+        // w24fda 2024-03-03
 
-    // execute the tar command
-    int ret = system(command);
+        // printf("received cmd : w24fda \n");
+        // extract date
+        char *date = buffer + 6;
+        // printf("date: %s\n", date);
 
-    // restore previous signal mask
-    sigprocmask(SIG_SETMASK, &prev_mask, NULL); 
-    
-    if (ret != 0) {
-        free(command);
-        fprintf(stderr, "error: failed to create the tar.gz archive\n");
-        return EXIT_FAILURE;
+        struct archive_job *job = create_archive_job(s, JOB_AFTER, date);
+        if (job != NULL) {
+            submit_job(s, job);
+        }
+    } else if (strncmp(buffer, "w24fq ", 6) == EXIT_SUCCESS) { // cmd 9
+        // w24fq type=pdf size>=1M mtime>=2024-03-01
+
+        struct archive_job *job = create_archive_job(s, JOB_QUERY, buffer + 6);
+        if (job != NULL) {
+            submit_job(s, job);
+        }
+    } else if (strncmp(buffer, "w24stats", 8) == EXIT_SUCCESS) {
+        char stats[4096];
+        cache_stats(stats, sizeof(stats));
+        size_t length = strlen(stats);
+        index_stats(stats + length, sizeof(stats) - length);
+        send_response(s, stats);
+    } else if (strncmp(buffer, "dirlist -a", 10) == EXIT_SUCCESS) {  // cmd 1
+        // List directories alphabetically
+        // printf("received cmd: dirlist -a\n");
+        send_directories(s, DIRLIST_BY_NAME, buffer + 10);
+    } else if (strncmp(buffer, "dirlist -t", 10) == EXIT_SUCCESS) { // cmd 2
+        // list directories BY creation time
+        send_directories(s, DIRLIST_BY_TIME, buffer + 10);
+    } else if (strncmp(buffer, "w24next ", 8) == EXIT_SUCCESS) { // cmd 10
+        // w24next 0-3-1
+        send_next_page(s, buffer + 8);
     } else {
-        free(command);
-        printf("tar file created\n");
-        return EXIT_SUCCESS;
+        // invalid command
+        send_response(s, "error: invalid command\n");
     }
 }
 
-void crequest(int client_socket) {
-    char buffer[1024] = {0};
-    while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        int valread = read(client_socket, buffer, 1024);
-
-        if (valread == 0 || strncmp(buffer, "quitc", 5) == EXIT_SUCCESS) { // cmd 8
-            char* response = "EXIT";
-            send_response(client_socket, response);
-
-            close(client_socket);
-            // forked child will exit
-            exit(EXIT_SUCCESS);
-        }
+//////////////////////////// MIRROR GAME START ///////////////////////////////////////
 
-        // process command and send response to client
-        if (strncmp(buffer, "w24fn ", 6) == EXIT_SUCCESS) { // cmd 3
-            // w24fn TEST2_1_word_2.pdf
+int send_connection_count(struct session *s, int number) {
+    // send the total size of the text response to the client
+    if (queue_output(s, &number, sizeof(int)) == EXIT_FAILURE) {
+        perror("error: sending connection count\n");
+        return EXIT_FAILURE;
+    }
 
-            // printf("received cmd : w24fn \n");
-            // extract filename from the command
-            char *filename = buffer + 6;
-            // printf("received cmd filename : %s \n", filename);
+    printf("sent connection count\n");
+    return EXIT_SUCCESS;
+}
 
-            // Search for the file starting from the home directory
-            search_file(filename, client_socket);
-        } else if (strncmp(buffer, "w24fz ", 6) == EXIT_SUCCESS) { // cmd 4
-            // w24fz 1227 69879
+// for handling server requests
+// send COUNT
+void srequest(struct session *s, char *buffer) {
+//     printf("received some CMD : %s\n", buffer);
 
-            clear_file_paths();
+    if (strncmp(buffer, "COUNT", 5) == EXIT_SUCCESS) { // cmd COUNT
 
-            // printf("received cmd : w24fz \n");
-            // Extract size1 and size2 from the command
-            char *sizes = buffer + 6;
-            // printf("sizes: %s\n", sizes);
+        if(send_connection_count(s, client_count()) == EXIT_FAILURE){
+            perror("error: sending connection count\n");
+        }
+    }
 
-            off_t size1, size2;
-            if (sscanf(sizes, "%ld %ld", &size1, &size2) != 2 || size1 < 0 || size2 < 0 || size1 > size2) {
-                send_response(client_socket, "error : invalid size range\n");
-                continue;
-            }
+    // close the connection once the count is written
+    s->state = SESSION_CLOSING;
+}
 
-            if(create_file_list(size1, size2) == EXIT_FAILURE) {
-                send_response(client_socket, "No file found\n");
-                continue;
-            }
+//////////////////////////// MIRROR GAME END ///////////////////////////////////////
 
-            if (create_tar_gz_v2(TAR_FILE_NAME) == EXIT_FAILURE) {
-                send_response(client_socket, "error: failed to create the tar.gz archive.\n");
-                continue;
-            }
 
-            if (send_tar_file(client_socket, TAR_FILE_NAME) == EXIT_FAILURE) {
-                printf("error : tar file send operation failed\n");
-                continue;
-            }
+//////////////////////////// EVENT LOOP START ///////////////////////////////////////
 
-            printf("tar file send operation successful\n");
-        } else if (strncmp(buffer, "w24ft ", 6) == EXIT_SUCCESS) { // cmd 5
-            // w24ft c txt pdf
-            // w24ft pdf
-            // w24ft c txt pdf pptx
+int epoll_fd = -1;
 
-            clear_file_paths();
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("error: fcntl O_NONBLOCK");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-            char *extension_str = buffer + 6;
-            // printf("extentions: %s\n", extension_str); // Debug print
+// allow as many open sockets as the hard limit permits
+void raise_open_file_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            perror("error: setrlimit");
+        }
+    }
+}
 
-            // printf("extension string: %s\n", extension_str);
+struct session *open_session(int socket, struct sockaddr_in *address) {
+    struct session *s = calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        perror("error: allocating session\n");
+        return NULL;
+    }
 
-            if(create_file_list_on_file_types(extension_str) == EXIT_FAILURE) {
-                send_response(client_socket, "No file found\n");
-                continue;
-            }
+    s->socket = socket;
+    s->state = SESSION_HANDSHAKE;
+    s->tar_fd = -1;
+    inet_ntop(AF_INET, &address->sin_addr, s->client_ip, sizeof(s->client_ip));
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = s;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) < 0) {
+        perror("error: epoll_ctl add");
+        free(s);
+        return NULL;
+    }
 
-            if (create_tar_gz_v2(TAR_FILE_NAME) == EXIT_FAILURE) {
-                send_response(client_socket, "error: failed to create the tar.gz archive\n");
-                continue;
-            }
+    return s;
+}
 
-            if (send_tar_file(client_socket, TAR_FILE_NAME) == EXIT_FAILURE) {
-                printf("error: tar file send operation failed\n");
-                continue;
-            }
+void stop_counting(struct session *s);
 
-            printf("tar file send operation successful\n");
-        } else if (strncmp(buffer, "w24fdb ", 6) == EXIT_SUCCESS) { // cmd 6
-            // w24fdb 2024-03-03
+void close_session(struct session *s) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->socket, NULL);
+    close(s->socket);
 
-            clear_file_paths();
+    if (s->state == SESSION_BALANCING || s->state == SESSION_COUNTING) {
+        stop_counting(s);
+    }
 
-            // printf("received cmd: w24fdb \n");
-            // extract date
-            char *date = buffer + 6;
-            // printf("date: %s\n", date);
+    if (s->is_client) {
+        __atomic_sub_fetch(&workers[worker_id].connections, 1, __ATOMIC_RELAXED);
+        printf("client disconnected : %s\n", s->client_ip);
+        printf("total connected clients: %d\n", client_count());
+    }
 
-            if (create_file_list_on_date(date, 1) == EXIT_FAILURE) {
-                send_response(client_socket, "No file found\n");
-                continue;
-            }
+    if (s->tar_fd >= 0) {
+        close_tar_file(s);
+    }
+    if (s->job != NULL && s->job->completed) {
+        // stream cut short after the job finished
+        free_job(s->job);
+    } else if (s->job != NULL) {
+        // the pool thread still owns the job, finish_job() frees it
+        s->job->session = NULL;
+    }
+    free_listing(s->listing);
+    free(s->out_buf);
+    free(s);
+}
 
-            if (create_tar_gz_v2(TAR_FILE_NAME) == EXIT_FAILURE) {
-                send_response(client_socket, "error: failed to create the tar.gz archive.\n");
-                continue;
-            }
+// write pending output and switch the socket between reading and writing
+void update_session(struct session *s) {
+    if (s->state == SESSION_SENDING || s->state == SESSION_CLOSING) {
+        int status = flush_session(s);
+        if (status < 0) {
+            close_session(s);
+            return;
+        }
 
-            if (send_tar_file(client_socket, TAR_FILE_NAME) == EXIT_FAILURE) {
-                printf("error: tar file send operation failed\n");
-                continue;
+        if (status == 1) {
+            if (s->state == SESSION_CLOSING) {
+                close_session(s);
+                return;
             }
+            s->state = SESSION_COMMAND;
+        }
+        s->stream_waiting = status == 2;
+    }
 
-            printf("tar file send operation successful\n");
-        } else if (strncmp(buffer, "w24fda ", 6) == EXIT_SUCCESS) { // cmd 7
-            // w24fda 2024-03-03
-
-            clear_file_paths();
+    struct epoll_event event;
+    if (s->state == SESSION_WORKING || s->state == SESSION_BALANCING || s->stream_waiting) {
+        // only watch for the client going away while the job runs
+        event.events = EPOLLRDHUP;
+    } else if (s->state == SESSION_SENDING || s->state == SESSION_CLOSING) {
+        event.events = EPOLLOUT;
+    } else {
+        event.events = EPOLLIN;
+    }
+    event.data.ptr = s;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->socket, &event);
+}
 
-            // printf("received cmd : w24fda \n");
-            // extract date
-            char *date = buffer + 6;
-            // printf("date: %s\n", date);
+// CLIENT handshake : the connection counts of the other nodes are asked for on non-blocking
+// connections driven by the event loop, the client is answered once both are in; a node that
+// does not answer within BALANCE_TIMEOUT_MS counts 0, like one that can not be reached
+#define BALANCE_TIMEOUT_MS 2000
 
-            if (create_file_list_on_date(date, 2) == EXIT_FAILURE) {
-                send_response(client_socket, "No file found\n");
-                continue;
-            }
+// the other nodes, in the order of peer_counts
+int peer_ports[2] = {MIRROR_1_PORT, MIRROR_2_PORT};
 
-            if (create_tar_gz_v2(TAR_FILE_NAME) == EXIT_FAILURE) {
-                send_response(client_socket, "error: failed to create the tar.gz archive.\n");
-                continue;
-            }
+// running count requests of this worker, oldest first
+struct session *counting = NULL;
 
-            if (send_tar_file(client_socket, TAR_FILE_NAME) == EXIT_FAILURE) {
-                printf("error: tar file send operation failed\n");
-                continue;
-            }
+// answer a client from the connection counts of the nodes
+void balance_client(struct session *s) {
+    int connection = client_count();
 
-            printf("tar file send operation successful\n");
-        } else if (strncmp(buffer, "dirlist -a", 10) == EXIT_SUCCESS) {  // cmd 1
-            // List directories alphabetically
-            // printf("received cmd: dirlist -a\n");
-            FILE *fp;
+    // handle the load balancing ---> ONLY if CLIENT
+    // get other mirrors' connection count
+    int mirror1 = s->peer_counts[0];
+    int mirror2 = s->peer_counts[1];
 
-            // find ~ -maxdepth 1 -mindepth 1 -type d -printf '%f\n' | sort
+    int goToServer = (connection >= 3 && mirror1 >= 3 && mirror2 >= 3) && ((connection + mirror1 + mirror2 - 9) % 3) + 1 == 1 ? 1 : 0;
+    int goToMirror1 = (connection >= 3 && mirror1 >= 3 && mirror2 >= 3) && ((connection + mirror1 + mirror2 - 9) % 3) + 1 == 2 ? 1 : 0;
+    int goToMirror2 = (connection >= 3 && mirror1 >= 3 && mirror2 >= 3) && ((connection + mirror1 + mirror2 - 9) % 3) + 1 == 3 ? 1 : 0;
 
-            // list directories from home directory AND sort them by alphabetical order
-            // list directories alphabetically from home directory
-            char command[70] = "find ~ -maxdepth 1 -mindepth 1 -type d -printf '%f\n' | sort";
+    if(connection < 3 || goToServer == 1) {
+        // increase number of connection
+        __atomic_add_fetch(&workers[worker_id].connections, 1, __ATOMIC_RELAXED);
+        s->is_client = 1;
+        printf("client connected: %s\n", s->client_ip);
+        printf("total connected clients: %d\n", client_count());
 
-            fp = popen(command, "r");
-            if(fp == NULL){
-                send_response(client_socket, "error: failed to execute command\n");
-                continue;
-            }
+        s->state = SESSION_COMMAND;
+        send_response(s, "CONTINUE");
+    } else if(mirror1 < 3 || goToMirror1 == 1) {
 
-            textResponse = malloc(MAX_RESPONSE_LENGTH_TEXT * sizeof(char));
-            while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-                strcat(textResponse, buffer);
-            }
-            pclose(fp);
+        char response[100];
+        sprintf(response, "please connect to mirror1 at ip: %s port: %d\n", IP, MIRROR_1_PORT);
 
-            //TODO add error block
-            send_response(client_socket, textResponse);
-            free(textResponse);
-        } else if (strncmp(buffer, "dirlist -t", 10) == EXIT_SUCCESS) { // cmd 2
-            // list directories BY creation time
-            FILE *fp;
+        send_response(s, response);
+        s->state = SESSION_CLOSING;
+    }  else if(mirror2 < 3 || goToMirror2 == 1) {
 
-            // list directories from home directory AND sort them by time
-            // find ~ -maxdepth 1 -mindepth 1 -type d -printf '%T@ %p\n' | sort -n | awk '{print $2}' | xargs -I{} basename {}
-            char command[120] = "find ~ -maxdepth 1 -mindepth 1 -type d -printf '%T@ %p\n' | sort -n | awk '{print $2}' | xargs -I{} basename {}";
+        char response[100];
+        sprintf(response, "please connect to mirror2 at ip: %s port: %d\n", IP, MIRROR_2_PORT);
 
-            fp = popen(command, "r");
-            if(fp == NULL){
-                send_response(client_socket, "error: failed to execute command\n");
-                continue;
-            }
+        send_response(s, response);
+        s->state = SESSION_CLOSING;
+    }
+}
 
-            textResponse = malloc(MAX_RESPONSE_LENGTH_TEXT * sizeof(char));
-            while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-                strcat(textResponse, buffer);
+// detach a count request from its client, or a client from its count requests
+void stop_counting(struct session *s) {
+    if (s->state == SESSION_BALANCING) {
+        for (int i = 0; i < 2; i++) {
+            if (s->peers[i] != NULL) {
+                s->peers[i]->client = NULL;
+                s->peers[i] = NULL;
             }
-            pclose(fp);
-
-            //TODO add error block
-            send_response(client_socket, textResponse);
-            free(textResponse);
-        } else {
-            // invalid command
-            send_response(client_socket, "error: invalid command\n");
         }
+        return;
     }
-}
 
-//////////////////////////// MIRROR GAME START ///////////////////////////////////////
+    struct session **link = &counting;
+    while (*link != NULL && *link != s) {
+        link = &(*link)->count_next;
+    }
+    if (*link == s) {
+        *link = s->count_next;
+    }
+    if (s->client != NULL) {
+        s->client->peers[s->peer] = NULL;
+        s->client = NULL;
+    }
+}
 
-int sendServerReqType(int socket) {
-    char* cmd = "SERVER";
-    // printf("SENT value : %s\n", cmd);
-    if (send(socket, cmd, strlen(cmd), 0) < 0) {
-        perror("error: sending connection type failed\n");
-        return EXIT_FAILURE;
+// a count request is done, the client is answered with the last one
+void finish_count(struct session *peer, int count) {
+    struct session *client = peer->client;
+    if (client != NULL) {
+        client->peer_counts[peer->peer] = count;
     }
+    close_session(peer);
 
-    return EXIT_SUCCESS;
+    if (client != NULL && client->peers[0] == NULL && client->peers[1] == NULL) {
+        balance_client(client);
+        update_session(client);
+    }
 }
 
-int sendServerReqCOUNT(int socket) {
-    char* cmd = "COUNT";
-    // printf("SENT value : %s\n", cmd);
-    if (send(socket, cmd, strlen(cmd), 0) < 0) {
-        perror("error: sending connection type failed\n");
-        return EXIT_FAILURE;
+// connect to node `peer` without blocking, NULL when no connection could be started
+struct session *request_connection_count(struct session *client, int peer) {
+    int server_port = peer_ports[peer];
+    int mirror_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mirror_socket < 0) {
+        fprintf(stderr, "error: - socket creation failed port : %d\n", server_port);
+        return NULL;
     }
 
-    return EXIT_SUCCESS;
-}
+    struct sockaddr_in mirror_address;
+    memset(&mirror_address, 0, sizeof(mirror_address));
+    mirror_address.sin_family = AF_INET;
+    mirror_address.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, IP, &mirror_address.sin_addr) <= 0) {
+        fprintf(stderr, "error: - invalid address : %s port : %d\n", IP, server_port);
+        close(mirror_socket);
+        return NULL;
+    }
+    if (connect(mirror_socket, (struct sockaddr *) &mirror_address, sizeof(mirror_address)) < 0 && errno != EINPROGRESS) {
+        fprintf(stderr, "error: - connection failed port : %d\n", server_port);
+        close(mirror_socket);
+        return NULL;
+    }
 
-int send_connection_count(int client_socket, int number) {
-    // send the total size of the text response to the client
-    if (send(client_socket, &number, sizeof(int), 0) < 0) {
-        perror("error: sending connection count\n");
-        return EXIT_FAILURE;
+    struct session *s = calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        perror("error: allocating session\n");
+        close(mirror_socket);
+        return NULL;
+    }
+    s->socket = mirror_socket;
+    s->state = SESSION_COUNTING;
+    s->tar_fd = -1;
+    s->client = client;
+    s->peer = peer;
+    snprintf(s->client_ip, sizeof(s->client_ip), "%s", IP);
+    clock_gettime(CLOCK_MONOTONIC, &s->count_start);
+
+    // writable once connected
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = s;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mirror_socket, &event) < 0) {
+        perror("error: epoll_ctl add");
+        close(mirror_socket);
+        free(s);
+        return NULL;
     }
 
-    printf("sent connection count\n");
-    return EXIT_SUCCESS;
+    struct session **link = &counting;
+    while (*link != NULL) {
+        link = &(*link)->count_next;
+    }
+    *link = s;
+    return s;
 }
 
-int receiveInteger(int socket) {
-    int received_int;
-    if (recv(socket, &received_int, sizeof(received_int), 0) < 0) {
-        perror("error: receiving integer failed\n");
-
-        return 0;
+// the client waits in SESSION_BALANCING until the counts are in
+void start_balancing(struct session *s) {
+    s->state = SESSION_BALANCING;
+    for (int i = 0; i < 2; i++) {
+        s->peer_counts[i] = 0;
+        s->peers[i] = request_connection_count(s, i);
+    }
+    if (s->peers[0] == NULL && s->peers[1] == NULL) {
+        balance_client(s);
     }
-    return received_int;
 }
 
-int getConnectionCount(char* ip, int server_port){
-    int mirror_socket;
-    struct sockaddr_in mirror_address;
+// event on a count request : connected, send the request; readable, read the count
+void read_count(struct session *s) {
+    int server_port = peer_ports[s->peer];
+
+    if (!s->count_sent) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(s->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            fprintf(stderr, "error: - connection failed port : %d\n", server_port);
+            finish_count(s, 0);
+            return;
+        }
 
-    if ((mirror_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        fprintf(stderr, "error: - socket creation failed port : %d\n", server_port);
+        // connection type and COUNT at once, handle_connection_type() takes both
+        const char *request = "SERVERCOUNT";
+        if (send(s->socket, request, strlen(request), MSG_NOSIGNAL) != (ssize_t) strlen(request)) {
+            fprintf(stderr, "error: - send count request failed port : %d\n", server_port);
+            finish_count(s, 0);
+            return;
+        }
+        s->count_sent = 1;
 
-        return 0;
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = s;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->socket, &event);
+        return;
     }
 
-    mirror_address.sin_family = AF_INET;
-    mirror_address.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, ip, &mirror_address.sin_addr) <= 0) {
-        fprintf(stderr, "error: - invalid address : %s port : %d\n", ip, server_port);
-
-        return 0;
+    ssize_t n = recv(s->socket, (char *) &s->count + s->count_received, sizeof(int) - s->count_received, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
     }
+    if (n <= 0) {
+        fprintf(stderr, "error: receiving connection count failed port : %d\n", server_port);
+        finish_count(s, 0);
+        return;
+    }
+    s->count_received += n;
+    if (s->count_received == sizeof(int)) {
+        finish_count(s, s->count);
+    }
+}
 
-    if (connect(mirror_socket, (struct sockaddr *) &mirror_address, sizeof(mirror_address)) < 0) {
-        fprintf(stderr, "error: - connection failed port : %d\n", server_port);
-
-        return 0;
+// give up the count requests older than BALANCE_TIMEOUT_MS; returns the time until the
+// next one is due (the epoll_wait() timeout), -1 when none is running
+int expire_counts() {
+    while (counting != NULL && elapsed_ms(&counting->count_start) >= BALANCE_TIMEOUT_MS) {
+        fprintf(stderr, "error: connection count timed out port : %d\n", peer_ports[counting->peer]);
+        finish_count(counting, 0);
     }
+    return counting == NULL ? -1 : (int) (BALANCE_TIMEOUT_MS - elapsed_ms(&counting->count_start));
+}
 
-    // printf("connected to MIRROR\n");
+// some client/server connected and sent the TYPE
+void handle_connection_type(struct session *s, char *connection_type) {
+    // Check the received connection type
+    if (strncmp(connection_type, "SERVER", 6) == EXIT_SUCCESS) {
+        printf("connection type: SERVER\n");
 
-    // send connection type
-    if (sendServerReqType(mirror_socket) == EXIT_FAILURE) {
-        fprintf(stderr, "error: - connection type negotiation failed port : %d\n", server_port);
+        s->state = SESSION_SERVER;
+        // the COUNT request may arrive in the same segment
+        if (connection_type[6] != '\0') {
+            srequest(s, connection_type + 6);
+        }
 
-        close(mirror_socket);
-        return 0;
-    }
+    } else if (strncmp(connection_type, "CLIENT", 5) == EXIT_SUCCESS) {
+        printf("connection type: CLIENT\n");
 
-    // sleep for 500000 microseconds (500 milliseconds)
-    usleep(500000);
+        // the other nodes are asked for their counts while the event loop goes on
+        start_balancing(s);
+    } else {
+        printf("invalid connection type received\n");
 
-    // printf("sent CONN TYPE\n");
+        s->state = SESSION_CLOSING;
+    }
+}
 
-    // send COUNT request
-    if (sendServerReqCOUNT(mirror_socket) == EXIT_FAILURE) {
-        fprintf(stderr, "error: - send count request failed port : %d\n", server_port);
+// socket is readable : connection type, COUNT request or client command
+void read_session(struct session *s) {
+    char buffer[CMD_BUFFER_SIZE] = {0};
+    int valread = read(s->socket, buffer, sizeof(buffer) - 1);
 
-        close(mirror_socket);
-        return 0;
+    if (valread < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        perror("error: reading from socket");
+        close_session(s);
+        return;
     }
 
-    // printf("send CMD COUNT\n");
-
-    int con_count = receiveInteger(mirror_socket);
+    if (s->state == SESSION_HANDSHAKE) {
+        if (valread == 0) {
+            perror("error: receiving connection type failed");
+            close_session(s);
+            return;
+        }
+        handle_connection_type(s, buffer);
+    } else if (s->state == SESSION_SERVER) {
+        if (valread == 0) {
+            close_session(s);
+            return;
+        }
+        srequest(s, buffer);
+    } else if (s->state == SESSION_COMMAND) {
+        crequest(s, buffer, valread);
+    }
 
-    // printf("received COUNT\n");
+    update_session(s);
+}
 
-    close(mirror_socket);
+// accept every pending connection on the listening socket
+void accept_clients(int server_fd) {
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
 
-    // printf("closed mirror CONN\n");
+        int client_socket = accept(server_fd, (struct sockaddr *) &address, &addrlen);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("error: accept call failure");
+            }
+            return;
+        }
 
-    return con_count;
+        if (set_nonblocking(client_socket) == EXIT_FAILURE || open_session(client_socket, &address) == NULL) {
+            close(client_socket);
+        }
+    }
 }
 
-// for handling server requests
-// send COUNT
-void srequest(int s_socket) {
-    char buffer[1024] = {0};
+//////////////////////////// EVENT LOOP END ///////////////////////////////////////
 
-    memset(buffer, 0, sizeof(buffer));
-    int valread = read(s_socket, buffer, 1024);
-
-//     printf("received some CMD char length: %d\n", valread);
-//     printf("received some CMD : %s\n", buffer);
+// hand every finished job back to its session
+void collect_finished_jobs() {
+    uint64_t count;
+    if (read(pool.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("error: reading finished jobs");
+    }
 
-    if (strncmp(buffer, "COUNT", 5) == EXIT_SUCCESS) { // cmd COUNT
+    pthread_mutex_lock(&pool.lock);
+    struct archive_job *done = pool.done;
+    pool.done = NULL;
+    pthread_mutex_unlock(&pool.lock);
 
-        if(send_connection_count(s_socket, connection) == EXIT_FAILURE){
-            perror("error: sending connection count\n");
+    // progress first, a job in both lists is only freed by finish_job()
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        struct archive_job *job = pool.progress;
+        if (job != NULL) {
+            pool.progress = job->progress_next;
+            job->progress_queued = 0;
+        }
+        pthread_mutex_unlock(&pool.lock);
 
-            close(s_socket);
+        if (job == NULL) {
+            break;
         }
+        job_progress(job);
+    }
+
+    // the list is newest first, answer in finishing order
+    struct archive_job *ordered = NULL;
+    while (done != NULL) {
+        struct archive_job *next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
+    }
 
-        close(s_socket);
+    while (ordered != NULL) {
+        struct archive_job *next = ordered->next;
+        finish_job(ordered);
+        ordered = next;
     }
 }
 
-//////////////////////////// MIRROR GAME END ///////////////////////////////////////
+// accept and serve clients on this worker's listening socket, never returns
+void run_worker(int server_fd, int threads, int compress_threads) {
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        perror("error: epoll_create1");
+        exit(EXIT_FAILURE);
+    }
 
+    if (start_job_pool(threads) == EXIT_FAILURE || start_compress_pool(compress_threads) == EXIT_FAILURE) {
+        exit(EXIT_FAILURE);
+    }
 
-int main() {
-    // signal handler to handle child process exit
-    struct sigaction sa;
-    sa.sa_handler = handle_child_exit;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("error : sigaction");
+    // the listening socket is registered with a NULL session
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0) {
+        perror("error: epoll_ctl add");
+        exit(EXIT_FAILURE);
+    }
 
+    // finished jobs are signaled with the pool itself as marker
+    event.events = EPOLLIN;
+    event.data.ptr = &pool;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pool.event_fd, &event) < 0) {
+        perror("error: epoll_ctl add");
         exit(EXIT_FAILURE);
     }
 
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, expire_counts());
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("error: epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct session *s = events[i].data.ptr;
+
+            if (s == NULL) {
+                accept_clients(server_fd);
+            } else if ((void *) s == &pool) {
+                collect_finished_jobs();
+            } else if (s->state == SESSION_COUNTING) {
+                read_count(s);
+            } else if (s->state == SESSION_WORKING || s->state == SESSION_BALANCING || s->stream_waiting) {
+                // client hung up while its job runs or the counts are asked for
+                close_session(s);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                close_session(s);
+            } else if (events[i].events & EPOLLOUT) {
+                update_session(s);
+            } else {
+                read_session(s);
+            }
+        }
+    }
+}
+
+// create a listening socket on the port, shared with the other workers by SO_REUSEPORT
+int create_listener(int port, int backlog) {
     struct sockaddr_in server;
     int server_fd, opt = 1;
 
-    int addrlen = sizeof(server);
-
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("error: running server!");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
         perror("error: setsockopt");
-        exit(EXIT_FAILURE);
+        close(server_fd);
+        return -1;
     }
 
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(SERVER_PORT);
+    server.sin_port = htons(port);
 
     if (bind(server_fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
         perror("error: port bind failed\n");
-        exit(EXIT_FAILURE);
+        close(server_fd);
+        return -1;
     }
 
-    if (listen(server_fd, MAX_CLIENTS) < 0) {
+    if (listen(server_fd, backlog) < 0) {
         perror("error: listen call failure\n");
-        exit(EXIT_FAILURE);
+        close(server_fd);
+        return -1;
     }
 
-    printf("%s is running. listening on port %d\n", SERVER_NAME, SERVER_PORT);
-
-    while (1) {
-        int client_socket = 1;
+    if (set_nonblocking(server_fd) == EXIT_FAILURE) {
+        close(server_fd);
+        return -1;
+    }
 
-        if ((client_socket = accept(server_fd, (struct sockaddr *) &server, (socklen_t *) &addrlen)) < 0) {
-            perror("error: accept call failure");
-            exit(EXIT_FAILURE);
-        }
+    return server_fd;
+}
 
-        // ready to accept connections
-        char connection_type[10];
-        // receive connection type from connected client
-        if (recv(client_socket, connection_type, sizeof(connection_type), 0) <= 0) {
-            perror("error: receiving connection type failed");
+// fork the worker for the given slot, it inherits only its own listening socket
+pid_t spawn_worker(int id, int *listeners, int threads, int compress_threads) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("error: fork worker");
+        return -1;
+    }
 
-            close(client_socket);
-            continue;
+    if (pid == 0) {
+        worker_id = id;
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        // the index lock stays with the server process
+        close(shared.control_fd);
+        for (int i = 0; i < worker_count; i++) {
+            if (i != id) {
+                close(listeners[i]);
+            }
         }
+        run_worker(listeners[id], threads, compress_threads);
+        exit(EXIT_SUCCESS);
+    }
 
-        // some client/server tried to connect and sent the TYPE
+    workers[id].pid = pid;
+    return pid;
+}
 
-        // Check the received connection type
-        if (strncmp(connection_type, "SERVER", 6) == EXIT_SUCCESS) {
-            printf("connection type: SERVER\n");
+volatile sig_atomic_t stop_server = 0;
 
-            srequest(client_socket);
-            continue;
+void handle_stop(int signum) {
+    (void) signum;
+    stop_server = 1;
+}
 
-        } else if (strncmp(connection_type, "CLIENT", 5) == EXIT_SUCCESS) {
-            printf("connection type: CLIENT\n");
+void print_usage(char *program) {
+    fprintf(stderr, "usage: %s [-w workers] [-b listen backlog] [-t pool threads per worker] [-z compression threads per worker]\n"
+                    "       [-m archive memory budget per worker (MB)] [-d archive disk budget per worker (MB, 0 = unlimited)] [-s spill directory]\n"
+                    "       [-C archive cache per worker (MB, 0 = off)] [-j directory scan threads] [-i index snapshot file, off = none]\n"
+                    "       [-p poll directories every N seconds instead of inotify]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    int backlog = DEFAULT_LISTEN_BACKLOG;
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int compress_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    // stat() latency bound, more threads than cores still pay off on network file systems
+    scan_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+
+    int option;
+    while ((option = getopt(argc, argv, "w:b:t:z:m:d:s:C:j:i:p:")) != -1) {
+        if (option == 'w') {
+            worker_count = atoi(optarg);
+        } else if (option == 'b') {
+            backlog = atoi(optarg);
+        } else if (option == 't') {
+            threads = atoi(optarg);
+        } else if (option == 'z') {
+            compress_threads = atoi(optarg);
+        } else if (option == 'm') {
+            staging.memory_limit = atol(optarg) * 1024L * 1024L;
+        } else if (option == 'd') {
+            staging.disk_limit = atol(optarg) * 1024L * 1024L;
+        } else if (option == 's') {
+            staging.spill_dir = optarg;
+        } else if (option == 'C') {
+            cache.limit = atol(optarg) * 1024L * 1024L;
+        } else if (option == 'j') {
+            scan_threads = atoi(optarg);
+        } else if (option == 'i') {
+            snprintf(snapshot_path, sizeof(snapshot_path), "%s", strcmp(optarg, "off") == 0 ? "" : optarg);
+        } else if (option == 'p') {
+            poll_interval = atoi(optarg);
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-            // handle the load balancing ---> ONLY if CLIENT
-            // get other mirrors' connection count
-            int mirror1 = getConnectionCount(IP, MIRROR_1_PORT);
-            int mirror2 = getConnectionCount(IP, MIRROR_2_PORT);
+    if (worker_count < 1 || worker_count > MAX_WORKERS || backlog < 1 || threads < 1 || compress_threads < 1 ||
+        staging.memory_limit < 0 || staging.disk_limit < 0 || cache.limit < 0 || scan_threads < 1 || poll_interval < 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
-            int goToServer = (connection >= 3 && mirror1 >= 3 && mirror2 >= 3) && ((connection + mirror1 + mirror2 - 9) % 3) + 1 == 1 ? 1 : 0;
-            int goToMirror1 = (connection >= 3 && mirror1 >= 3 && mirror2 >= 3) && ((connection + mirror1 + mirror2 - 9) % 3) + 1 == 2 ? 1 : 0;
-            int goToMirror2 = (connection >= 3 && mirror1 >= 3 && mirror2 >= 3) && ((connection + mirror1 + mirror2 - 9) % 3) + 1 == 3 ? 1 : 0;
+    if (access(staging.spill_dir, W_OK | X_OK) < 0) {
+        fprintf(stderr, "error: spill directory %s : %s\n", staging.spill_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-            if(connection < 3 || goToServer == 1) {
-                // increase number of connection
-                connection++;
-                char *client = inet_ntoa(server.sin_addr);
-                printf("client connected: %s\n", client);
-                printf("total connected clients: %d\n", connection);
+    // sockets closed by clients must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    raise_open_file_limit();
+    // resolve the export directory before any pool thread exists
+    get_directory();
+    // the workers read the index from shared memory, kept by one server process on the host
+    if (shared_index_open() == EXIT_FAILURE) {
+        exit(EXIT_FAILURE);
+    }
 
-                send_response(client_socket, "CONTINUE");
+    // connection counts of all workers live in shared memory for load balancing
+    workers = mmap(NULL, MAX_WORKERS * sizeof(struct worker_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED) {
+        perror("error: mmap worker slots");
+        exit(EXIT_FAILURE);
+    }
 
-                if (!fork()) {
-                    close(server_fd);
-                    crequest(client_socket);
-                    printf("client disconnected : %s\n", client);
-                }
-                close(client_socket);
-            } else if(mirror1 < 3 || goToMirror1 == 1) {
+    // every worker accepts on its own socket, the kernel spreads the connections
+    int listeners[MAX_WORKERS];
+    for (int i = 0; i < worker_count; i++) {
+        if ((listeners[i] = create_listener(SERVER_PORT, backlog)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-                char response[100];
-                sprintf(response, "please connect to mirror1 at ip: %s port: %d\n", IP, MIRROR_1_PORT);
+    struct sigaction sa;
+    sa.sa_handler = handle_stop;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-                send_response(client_socket, response);
-                close(client_socket);
-            }  else if(mirror2 < 3 || goToMirror2 == 1) {
+    for (int i = 0; i < worker_count; i++) {
+        if (spawn_worker(i, listeners, threads, compress_threads) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-                char response[100];
-                sprintf(response, "please connect to mirror2 at ip: %s port: %d\n", IP, MIRROR_2_PORT);
+    // forked first : the workers do not need a copy of the index in their memory
+    if (start_index_writer() == EXIT_FAILURE) {
+        exit(EXIT_FAILURE);
+    }
 
-                send_response(client_socket, response);
-                close(client_socket);
+    printf("%s is running. listening on port %d\n", SERVER_NAME, SERVER_PORT);
+    printf("workers: %d, listen backlog: %d, pool threads per worker: %d, compression threads per worker: %d\n",
+           worker_count, backlog, threads, compress_threads);
+    printf("archive staging per worker: %ld MB memory, %ld MB disk in %s, archive cache: %ld MB\n",
+           (long) (staging.memory_limit >> 20), (long) (staging.disk_limit >> 20), staging.spill_dir, (long) (cache.limit >> 20));
+    fflush(stdout);
+
+    // restart workers that died, their listening socket kept its pending connections
+    while (!stop_server) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-        } else {
-            printf("invalid connection type received\n");
+            perror("error: wait");
+            break;
+        }
 
-            close(client_socket);
-            continue;
+        for (int i = 0; i < worker_count; i++) {
+            if (workers[i].pid == pid && !stop_server) {
+                fprintf(stderr, "error: worker %d (pid %d) exited, restarting\n", i, pid);
+                workers[i].connections = 0;
+                sleep(1);
+                spawn_worker(i, listeners, threads, compress_threads);
+            }
         }
+    }
 
+    for (int i = 0; i < worker_count; i++) {
+        kill(workers[i].pid, SIGTERM);
     }
+    while (wait(NULL) > 0);
+    shared_index_close();
 
     return EXIT_SUCCESS;
 }
@@ -974,3 +7058,9 @@ int main() {
 
 // #6 w24fdb 2024-03-03
 // #7 w24fda 2024-03-03
+
+// #9 w24fq type=pdf size>=1M size<=10M mtime>=2024-03-01
+
+// #1 dirlist -a -p 100
+// #3 w24fn TEST2 -p 50
+// #10 w24next 0-1-1